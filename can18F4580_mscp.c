@@ -20,6 +20,8 @@
 ////                                                                 ////
 ////     can_set_standard_id - Sets only standard ID                 ////
 ////                                                                 ////
+////     can_set_sid - Sets a standard ID from SIDH:SIDL bytes       ////
+////                                                                 ////
 ////    can_get_id - Gets the standard and extended ID*              ////
 ////                                                                 ////
 ////     can_get_extended_id - Gets only extended ID                 ////
@@ -60,6 +62,12 @@
 ////                                                                 ////
 ////     can_fifo_getd - retrive data in FIFO mode (2)               ////
 ////                                                                 ////
+////     can_fifo_getd_hit - retrive data and filter hit in FIFO     ////
+////                         mode (2), without decoding the ID       ////
+////                                                                 ////
+////     can_fifo_getd_sid - retrive data and SIDH:SIDL in FIFO      ////
+////                         mode (2), without decoding the ID       ////
+////                                                                 ////
 ////     can_t0_putd                                                 ////
 ////     can_t1_putd                                                 ////
 ////     can_t2_putd                                                 ////
@@ -115,6 +123,12 @@
 /////////////////////////////////////////////////////////////////////////
 
 #include <can18F4580_mscp.h>
+#include "can_telem.h"
+
+#if (CAN_RX_FILTERS_USED > CAN_N_RX_FILTERS) || (CAN_RX_FILTERS_USED == 0)
+ #error CAN_MISC_TABLE needs CAN_RX_FILTERS_USED acceptance filters, only CAN_N_RX_FILTERS are available
+#endif
+#error /information CAN acceptance filters in use: CAN_RX_FILTERS_USED of CAN_N_RX_FILTERS, masks in use: CAN_RX_MASKS_USED of 2
 
 #if CAN_DO_DEBUG
  #use rs232(baud=9600, xmit=PIN_C6, rcv=PIN_C7)
@@ -134,12 +148,34 @@
 unsigned int curmode;
 unsigned int curfunmode;
 
+// acceptance filter registers, in filter number order
+const int16 can_rx_filter_addr[CAN_N_RX_FILTERS] = {
+   RXFILTER0,  RXFILTER1,  RXFILTER2,  RXFILTER3,
+   RXFILTER4,  RXFILTER5,  RXFILTER6,  RXFILTER7,
+   RXFILTER8,  RXFILTER9,  RXFILTER10, RXFILTER11,
+   RXFILTER12, RXFILTER13, RXFILTER14, RXFILTER15 };
+
+// IDs accepted by the acceptance filters, filter n accepts entry n of
+// CAN_MISC_TABLE
+#if CAN_USE_EXTENDED_ID
+const int32 can_rx_filter_id[CAN_RX_FILTERS_USED] = {
+   CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ARRAY) };
+#else
+// standard IDs are stored as the SIDH:SIDL register bytes, worked out at
+// compile time
+const int16 can_rx_filter_sid[CAN_RX_FILTERS_USED] = {
+   CAN_MISC_TABLE(EXPAND_AS_MISC_SID_ARRAY) };
+#endif
+
 ////////////////////////////////////////////////////////////////////////
 //
 // can_init()
 //
 // Initializes PIC18xxx8 CAN peripheral.  Sets the RX filter and masks so the
-// CAN peripheral will receive all incoming IDs.  Configures both RX buffers
+// CAN peripheral will only receive the IDs listed in CAN_MISC_TABLE, one
+// acceptance filter per ID with both masks set to an exact match.  Unused
+// filters are disabled through RXFCON0/1 while still in config mode, before
+// the ECAN is switched to CAN_FUNCTIONAL_MODE.  Configures both RX buffers
 // to only accept valid valid messages (as opposed to all messages, or all
 // extended message, or all standard messages).  Also sets the tri-state
 // setting of B2 to output, and B3 to input (apparently the CAN peripheral
@@ -152,6 +188,8 @@ unsigned int curfunmode;
 //
 //////////////////////////////////////////////////////////////////////////////
 void can_init(void) {
+   int8 i;
+
    can_set_mode(CAN_OP_CONFIG);   //must be in config mode before params can be set
    can_set_baud();
    curfunmode=CAN_FUN_OP_LEGACY;
@@ -172,31 +210,42 @@ void can_init(void) {
    CIOCON.tx2src=CAN_CANTX2_SOURCE;       //added for PIC18F6585/8585/6680/8680
    CIOCON.tx2en=CAN_ENABLE_CANTX2;        //added for PIC18F6585/8585/6680/8680
 
-   can_set_id(RX0MASK, CAN_MASK_ACCEPT_ALL, CAN_USE_EXTENDED_ID);  //set mask 0
-   can_set_id(RXFILTER0, 0, CAN_USE_EXTENDED_ID);  //set filter 0 of mask 0
-   can_set_id(RXFILTER1, 0, CAN_USE_EXTENDED_ID);  //set filter 1 of mask 0
-
-   can_set_id(RX1MASK, CAN_MASK_ACCEPT_ALL, CAN_USE_EXTENDED_ID);  //set mask 1
-   can_set_id(RXFILTER2, 0, CAN_USE_EXTENDED_ID);  //set filter 0 of mask 1
-   can_set_id(RXFILTER3, 0, CAN_USE_EXTENDED_ID);  //set filter 1 of mask 1
-   can_set_id(RXFILTER4, 0, CAN_USE_EXTENDED_ID);  //set filter 2 of mask 1
-   can_set_id(RXFILTER5, 0, CAN_USE_EXTENDED_ID);  //set filter 3 of mask 1
-
-   // set dynamic filters
-   can_set_id(RXFILTER6, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER7, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER8, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER9, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER10, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER11, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER12, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER13, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER14, 0, CAN_USE_EXTENDED_ID);
-   can_set_id(RXFILTER15, 0, CAN_USE_EXTENDED_ID);
- 
+#if CAN_USE_EXTENDED_ID
+   can_set_id(RX0MASK, CAN_MASK_EXACT_ID, CAN_USE_EXTENDED_ID);  //set mask 0
+   can_set_id(RX1MASK, CAN_MASK_EXACT_ID, CAN_USE_EXTENDED_ID);  //set mask 1
+
+   // set one filter per CAN_MISC_TABLE entry, clear the rest
+   for (i=0; i<CAN_N_RX_FILTERS; i++)
+   {
+      if (i < CAN_RX_FILTERS_USED)
+         can_set_id((int8 *)can_rx_filter_addr[i], can_rx_filter_id[i], CAN_USE_EXTENDED_ID);
+      else
+         can_set_id((int8 *)can_rx_filter_addr[i], 0, CAN_USE_EXTENDED_ID);
+   }
+#else
+   can_set_sid(RX0MASK, CAN_STD_SID16(CAN_MASK_EXACT_ID));  //set mask 0
+   can_set_sid(RX1MASK, CAN_STD_SID16(CAN_MASK_EXACT_ID));  //set mask 1
+
+   // set one filter per CAN_MISC_TABLE entry, clear the rest
+   for (i=0; i<CAN_N_RX_FILTERS; i++)
+   {
+      if (i < CAN_RX_FILTERS_USED)
+         can_set_sid((int8 *)can_rx_filter_addr[i], can_rx_filter_sid[i]);
+      else
+         can_set_sid((int8 *)can_rx_filter_addr[i], 0);
+   }
+#endif
+
+   // associate every filter with mask 0 and enable only the used filters
+   msel0=0;
+   msel1=0;
+   msel2=0;
+   msel3=0;
+   RXFCON0=make8(CAN_RX_FILTER_ENABLE,0);
+   RXFCON1=make8(CAN_RX_FILTER_ENABLE,1);
+
    can_set_mode(CAN_OP_NORMAL);
-   curfunmode=CAN_FUN_OP_ENHANCED_FIFO;
-   can_set_functional_mode(curfunmode);
+   can_set_functional_mode(CAN_FUNCTIONAL_MODE);
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -416,7 +465,9 @@ void can_set_functional_mode(CAN_FUN_OP_MODE mode)
 //            For example, a pointer to RXM1EIDL
 //
 //     id - ID to set buffer to
-//     ext - Set to TRUE if this buffer uses an extended ID, FALSE if not
+//     ext - Set to TRUE if this buffer uses an extended ID, FALSE if not.
+//           Ignored unless CAN_USE_EXTENDED_ID is TRUE, only the standard ID
+//           code is compiled otherwise.
 //
 ////////////////////////////////////////////////////////////////////////
 void can_set_id(int8 *addr, int32 id, int1 ext) {
@@ -424,6 +475,7 @@ void can_set_id(int8 *addr, int32 id, int1 ext) {
 
    //ptr=addr;
 
+#if CAN_USE_EXTENDED_ID
    if (ext) {  //extended
       //eidl
       *addr=make8(id,0); //0:7
@@ -444,7 +496,9 @@ void can_set_id(int8 *addr, int32 id, int1 ext) {
       *addr=((make8(id,2) >> 5) & 0x07 ); //21:23
       *addr|=((make8(id,3) << 3) & 0xF8);//24:28
    }
-   else {   //standard
+   else
+#endif
+   {   //standard
       //eidl
       *addr=0;
 
@@ -494,6 +548,36 @@ void can_set_standard_id(int8 *addr, int32 id)
    *addr|=(make8(id,1) << 5) & 0xE0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_set_sid
+//
+// sets a standard id from its SIDH:SIDL register bytes, see CAN_STD_SID16()
+//
+// Parameters:
+//      addr - the address that is to be set to the id
+//      sid - SIDH in the upper byte, SIDL in the lower byte
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void can_set_sid(int8 *addr, int16 sid)
+{
+   //eidl
+   *addr=0;
+
+   //eidh
+   addr--;
+   *addr=0;
+
+   //sidl
+   addr--;
+   *addr=make8(sid,0);
+
+   //sidh
+   addr--;
+   *addr=make8(sid,1);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // can_set_extended_id
@@ -538,7 +622,9 @@ void can_set_extended_id(int8 *addr, int32 id)
 //   Paramaters:
 //     addr - pointer to first byte of ID register, starting with xxxxEIDL.
 //            For example, a pointer to RXM1EIDL
-//     ext - Set to TRUE if this buffer uses an extended ID, FALSE if not
+//     ext - Set to TRUE if this buffer uses an extended ID, FALSE if not.
+//           Ignored unless CAN_USE_EXTENDED_ID is TRUE, only the standard ID
+//           code is compiled otherwise.
 //
 //   Returns:
 //     The ID of the buffer
@@ -551,6 +637,7 @@ int32 can_get_id(int8 *addr, int1 ext) {
    ret=0;
    ptr=addr;
 
+#if CAN_USE_EXTENDED_ID
    if (ext) {
       ret=*ptr;  //eidl
 
@@ -565,7 +652,9 @@ int32 can_get_id(int8 *addr, int1 ext) {
       ret|=((int32)*ptr << 21);
 
    }
-   else {
+   else
+#endif
+   {
       ptr-=2;    //sidl
       ret=((int32)*ptr & 0xE0) >> 5;
 
@@ -662,28 +751,20 @@ int8 can_putd(int32 id, int8 *data, int8 len, int8 priority, int1 ext, int1 rtr)
     // map access bank addresses to empty transmitter
    if (!TXB0CON.txreq) 
    {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_TX0;
-      else
-         ECANCON.ewin=TX0;
+      can_set_window(CAN_WIN_TX0, TX0);
       port=0;
    }
    else if (!TXB1CON.txreq)
    {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_TX1;
-      else
-         ECANCON.ewin=TX1;
+      can_set_window(CAN_WIN_TX1, TX1);
       port=1;
    }
    else if (!TXB2CON.txreq) 
    {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_TX2;
-      else
-         ECANCON.ewin=TX2;
+      can_set_window(CAN_WIN_TX2, TX2);
       port=2;
    }
+#if CAN_FUNCTIONAL_MODE
    else if (!B0CONT.txreq && BSEL0.b0txen) 
    {
       ECANCON.ewin=TXRX0;
@@ -714,6 +795,7 @@ int8 can_putd(int32 id, int8 *data, int8 len, int8 priority, int1 ext, int1 rtr)
       ECANCON.ewin=TXRX5;
       port=8;
    }
+#endif
    else 
    {
       #if CAN_DO_DEBUG
@@ -741,10 +823,7 @@ int8 can_putd(int32 id, int8 *data, int8 len, int8 priority, int1 ext, int1 rtr)
    //enable transmission
    TXBaCON.txreq=1;
 
-   if(curfunmode==CAN_FUN_OP_LEGACY)
-      CANCON.win=CAN_WIN_RX0;
-   else
-      ECANCON.ewin=RX0;
+   can_set_window(CAN_WIN_RX0, RX0);
 
    #if CAN_DO_DEBUG
             can_debug("\r\nCAN_PUTD(): BUFF=%U ID=%LX LEN=%U PRI=%U EXT=%U RTR=%U\r\n", port, id, len, priority, ext, rtr);
@@ -787,55 +866,44 @@ int1 can_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat)
 
    if (RXB0CON.rxful)
    {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_RX0;
-      else
-         ECANCON.ewin=RX0;          // this is if in functional mode 1 or 2
+      can_set_window(CAN_WIN_RX0, RX0);
          
       stat.buffer=0;
 
       //CAN_INT_RXB0IF=0;           // moved to end of function
 
-      if(curfunmode)
-      {
-         stat.err_ovfl=COMSTAT_MODE_1.rxnovfl;
-         stat.filthit=RXB0CON_MODE_1.filthit;
-      }
-      else
-      {
-         stat.err_ovfl=COMSTAT.rx0ovfl;
-         COMSTAT.rx0ovfl=0;
+#if CAN_FUNCTIONAL_MODE
+      stat.err_ovfl=COMSTAT_MODE_1.rxnovfl;
+      stat.filthit=RXB0CON_MODE_1.filthit;
+#else
+      stat.err_ovfl=COMSTAT.rx0ovfl;
+      COMSTAT.rx0ovfl=0;
 
-         if (RXB0CON.rxb0dben) 
-         {
-            stat.filthit=RXB0CON.filthit0;
-         }
+      if (RXB0CON.rxb0dben) 
+      {
+         stat.filthit=RXB0CON.filthit0;
       }
+#endif
    }
    else if ( RXB1CON.rxful )
    {
-      if(curfunmode==CAN_FUN_OP_LEGACY)
-         CANCON.win=CAN_WIN_RX1;
-      else
-         ECANCON.ewin=RX1;
+      can_set_window(CAN_WIN_RX1, RX1);
          
       stat.buffer=1;
 
       //CAN_INT_RXB1IF=0;           //moved to end of function
 
-      if(curfunmode)
-      {
-         stat.err_ovfl=COMSTAT_MODE_1.rxnovfl;
-         stat.filthit=RXB1CON_MODE_1.filthit;
-      }
-      else
-      {
-         stat.err_ovfl=COMSTAT.rx1ovfl;
-         COMSTAT.rx1ovfl=0;
+#if CAN_FUNCTIONAL_MODE
+      stat.err_ovfl=COMSTAT_MODE_1.rxnovfl;
+      stat.filthit=RXB1CON_MODE_1.filthit;
+#else
+      stat.err_ovfl=COMSTAT.rx1ovfl;
+      COMSTAT.rx1ovfl=0;
 
-         stat.filthit=RXB1CON.filthit;
-      }
+      stat.filthit=RXB1CON.filthit;
+#endif
    }
+#if CAN_FUNCTIONAL_MODE
    else if (B0CONR.rxful && !BSEL0.b0txen)
    {
       ECANCON.ewin=TXRX0;
@@ -914,6 +982,7 @@ int1 can_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat)
       //B5CONR.rxful=0;          //moved to end of function because this shouldn't be
                                  //cleared until after data has been retrieved from buffer
    }
+#endif
    else
    {
       #if CAN_DO_DEBUG
@@ -940,15 +1009,17 @@ int1 can_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat)
    {
       case 0:
          RXB0CON.rxful=0;
-         if(curfunmode)
-            CAN_INT_RXB1IF=0;
-         else
-            CAN_INT_RXB0IF=0;
+#if CAN_FUNCTIONAL_MODE
+         CAN_INT_RXB1IF=0;
+#else
+         CAN_INT_RXB0IF=0;
+#endif
          break;
       case 1:
          RXB1CON.rxful=0;
          CAN_INT_RXB1IF=0;
          break;
+#if CAN_FUNCTIONAL_MODE
       case 2:
          B0CONR.rxful=0;
          CAN_INT_RXB1IF=0;
@@ -973,16 +1044,14 @@ int1 can_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat)
          B5CONR.rxful=0;
          CAN_INT_RXB1IF=0;
          break;
+#endif
    }
    
    stat.inv=CAN_INT_IRXIF;
    CAN_INT_IRXIF = 0;
       
    // return to default addressing
-   if(curfunmode==CAN_FUN_OP_LEGACY)
-      CANCON.win=CAN_WIN_RX0;
-   else
-      ECANCON.ewin=RX0;
+   can_set_window(CAN_WIN_RX0, RX0);
 
    #if CAN_DO_DEBUG
       can_debug("\r\nCAN_GETD(): BUFF=%U ID=%LX LEN=%U OVF=%U ", stat.buffer, id, len, stat.err_ovfl);
@@ -1438,6 +1507,10 @@ void can_associate_filter_to_mask(CAN_MASK_FILTER_ASSOCIATE mask, CAN_FILTER_ASS
 // Returns:
 //      int1 - TRUE if there was data in the buffer, FALSE if there wasn't
 //
+//   stat.err_ovfl is set if the FIFO overflowed since the last call, the
+//   overflow flag is cleared so every overflow is only reported once.  Call
+//   until it returns FALSE to drain the FIFO.
+//
 // More information can be found on the FIFO mode in the PIC18F4580 datasheet
 // section 23.7.3
 //
@@ -1457,6 +1530,7 @@ int1 can_fifo_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat )
    //CAN_INT_RXB1IF=0;                    // moved to end of function
 
    stat.err_ovfl=COMSTAT_MODE_2.rxnovfl;
+   COMSTAT_MODE_2.rxnovfl=0;               // report each overflow only once
    stat.filthit=RXB0CON_MODE_2.filthit;
 
    len = RXBaDLC.dlc;
@@ -1485,6 +1559,127 @@ int1 can_fifo_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat )
    return(1);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_fifo_getd_hit
+//
+// Retreives data in Mode 2 without reading back the ID.  The frame is
+// identified by the acceptance filter that accepted it (stat.filthit), which
+// avoids the 32 bit shifts in can_get_id().  Only useful when every filter
+// accepts a single ID, as set up by can_init().
+//
+// Parameters:
+//      data - Address of the array to store the data in
+//      len - number of data bytes to read
+//      stat - status structure to return infromation about the receive register
+//
+// Returns:
+//      int1 - TRUE if there was data in the buffer, FALSE if there wasn't
+//
+////////////////////////////////////////////////////////////////////////////////
+int1 can_fifo_getd_hit(int8 *data, int8 &len, struct rx_stat &stat)
+{
+   int8 i;
+   int8 *ptr;
+
+   if(!COMSTAT_MODE_2.fifoempty)          // if there is no data in the buffer
+      return(0);                          // return false;
+
+   ECANCON.ewin=CANCON_MODE_2.fp | 0x10;
+   stat.buffer=CANCON_MODE_2.fp;
+
+   stat.err_ovfl=COMSTAT_MODE_2.rxnovfl;
+   COMSTAT_MODE_2.rxnovfl=0;               // report each overflow only once
+   stat.filthit=RXB0CON_MODE_2.filthit;
+
+   len = RXBaDLC.dlc;
+   if (len > CAN_MAX_DLC)                  // DLC 9-15 would overrun data[]
+      len = CAN_MAX_DLC;
+   stat.rtr=RXBaDLC.rtr;
+   stat.ext=TXRXBaSIDL.ext;
+
+   ptr = &TXRXBaD0;
+   for ( i = 0; i < len; i++ ) {
+       *data = *ptr;
+       data++;
+       ptr++;
+   }
+
+   RXB0CON_MODE_2.rxful=0;
+   
+   CAN_INT_RXB1IF=0;
+
+   // return to default addressing
+   ECANCON.ewin=RX0;
+
+   stat.inv=CAN_INT_IRXIF;
+   CAN_INT_IRXIF = 0;
+
+   return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_fifo_getd_sid
+//
+// Retreives data in Mode 2, returning the standard ID as the raw SIDH:SIDL
+// register bytes.  Compare sid against CAN_STD_SID16(id) of a constant ID
+// instead of building the 32 bit ID with can_get_id().
+//
+// Parameters:
+//      sid - SIDH:SIDL of the sender, the flag bits are masked off
+//      data - Address of the array to store the data in
+//      len - number of data bytes to read
+//      stat - status structure to return infromation about the receive register
+//
+// Returns:
+//      int1 - TRUE if there was data in the buffer, FALSE if there wasn't
+//
+////////////////////////////////////////////////////////////////////////////////
+int1 can_fifo_getd_sid(int16 &sid, int8 *data, int8 &len, struct rx_stat &stat)
+{
+   int8 i;
+   int8 *ptr;
+
+   if(!COMSTAT_MODE_2.fifoempty)          // if there is no data in the buffer
+      return(0);                          // return false;
+
+   ECANCON.ewin=CANCON_MODE_2.fp | 0x10;
+   stat.buffer=CANCON_MODE_2.fp;
+
+   stat.err_ovfl=COMSTAT_MODE_2.rxnovfl;
+   COMSTAT_MODE_2.rxnovfl=0;               // report each overflow only once
+   stat.filthit=RXB0CON_MODE_2.filthit;
+
+   len = RXBaDLC.dlc;
+   if (len > CAN_MAX_DLC)                  // DLC 9-15 would overrun data[]
+      len = CAN_MAX_DLC;
+   stat.rtr=RXBaDLC.rtr;
+   stat.ext=TXRXBaSIDL.ext;
+
+   ptr = TXRXBaID - 3;     //sidh
+   sid=make16(*ptr, *(ptr+1) & make8(CAN_STD_SID16_MASK,0));
+
+   ptr = &TXRXBaD0;
+   for ( i = 0; i < len; i++ ) {
+       *data = *ptr;
+       data++;
+       ptr++;
+   }
+
+   RXB0CON_MODE_2.rxful=0;
+   
+   CAN_INT_RXB1IF=0;
+
+   // return to default addressing
+   ECANCON.ewin=RX0;
+
+   stat.inv=CAN_INT_IRXIF;
+   CAN_INT_IRXIF = 0;
+
+   return(1);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // can_t0_putd - can_t2_putd
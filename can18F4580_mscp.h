@@ -27,6 +27,16 @@
   #define CAN_USE_EXTENDED_ID         FALSE
 #ENDIF
 
+//functional mode set by can_init(), fixed at build time so the driver only
+//compiles the code for that mode (0 = legacy, 1 = enhanced, 2 = enhanced FIFO)
+#ifndef CAN_FUNCTIONAL_MODE
+ #define CAN_FUNCTIONAL_MODE 2
+#endif
+
+#if (CAN_FUNCTIONAL_MODE < 0) || (CAN_FUNCTIONAL_MODE > 2)
+ #error CAN_FUNCTIONAL_MODE must be 0, 1 or 2
+#endif
+
 #IFNDEF CAN_BRG_SYNCH_JUMP_WIDTH
   #define CAN_BRG_SYNCH_JUMP_WIDTH  0  //synchronized jump width (def: 1 x Tq)
 #ENDIF
@@ -93,6 +103,14 @@ enum CAN_FUN_OP_MODE { CAN_FUN_OP_LEGACY=0,
                        CAN_FUN_OP_ENHANCED=1,
                        CAN_FUN_OP_ENHANCED_FIFO=2 };
 
+//maps a buffer into the access bank window, with CANCON.win in legacy mode
+//and ECANCON.ewin in the enhanced modes
+#if CAN_FUNCTIONAL_MODE == 0
+ #define can_set_window(legacy_win, enhanced_win) (CANCON.win=(legacy_win))
+#else
+ #define can_set_window(legacy_win, enhanced_win) (ECANCON.ewin=(enhanced_win))
+#endif
+
 enum CAN_WIN_ADDRESS {   CAN_WIN_RX0=0,
                         CAN_WIN_RX1=5,
                         CAN_WIN_TX0=4,
@@ -980,6 +998,36 @@ struct rxbNdlc_struct RXBaDLC;
 //value to put in mask field to accept all incoming id's
 #define CAN_MASK_ACCEPT_ALL   0
 
+//value to put in mask field to accept only an exact id match
+#if CAN_USE_EXTENDED_ID
+ #define CAN_MASK_EXACT_ID    0x1FFFFFFF
+#else
+ #define CAN_MASK_EXACT_ID    0x7FF
+#endif
+
+//standard ID register bytes, worked out at compile time for constant IDs
+//the ID sits in SIDH:SIDL bits 15:5, the low bits of SIDL are flags
+#define CAN_STD_SIDH(id)      (((id) >> 3) & 0xFF)
+#define CAN_STD_SIDL(id)      (((id) << 5) & 0xE0)
+#define CAN_STD_SID16(id)     ((int16)(id) << 5)
+#define CAN_STD_SID16_MASK    0xFFE0
+
+//a frame never carries more than 8 data bytes, a DLC of 9-15 also means 8
+#define CAN_MAX_DLC           8
+
+//number of acceptance filters available in mode 1 & 2 (RXF0-RXF15)
+#define CAN_N_RX_FILTERS      16
+
+//acceptance filters and masks used by can_init(), one filter per entry of
+//CAN_MISC_TABLE (see can_telem.h), all filters share mask 0
+#ifndef CAN_RX_FILTERS_USED
+ #define CAN_RX_FILTERS_USED  N_CAN_COMMAND
+#endif
+#define CAN_RX_MASKS_USED     1
+
+//RXFCON1:RXFCON0 value enabling filters 0 to CAN_RX_FILTERS_USED-1
+#define CAN_RX_FILTER_ENABLE  (0xFFFF >> (CAN_N_RX_FILTERS - CAN_RX_FILTERS_USED))
+
 //can interrupt flags
 #bit CAN_INT_IRXIF = getenv("BIT:IRXIF")     //0xFA4.7
 #bit CAN_INT_WAKIF = getenv("BIT:WAKIF")     //0xFA4.6
@@ -1017,5 +1065,8 @@ void can_disable_filter(int16 filter);
 void can_associate_filter_to_buffer(CAN_FILTER_ASSOCIATION_BUFFERS buffer, CAN_FILTER_ASSOCIATION filter);
 void can_associate_filter_to_mask(CAN_MASK_FILTER_ASSOCIATE mask, CAN_FILTER_ASSOCIATION filter);
 int1 can_fifo_getd(int32 &id, int8 *data, int8 &len, struct rx_stat &stat);
+int1 can_fifo_getd_hit(int8 *data, int8 &len, struct rx_stat &stat);
+int1 can_fifo_getd_sid(int16 &sid, int8 *data, int8 &len, struct rx_stat &stat);
+void can_set_sid(int8 *addr, int16 sid);
 
 #endif
@@ -0,0 +1,105 @@
+#include "can_rtr.h"
+
+// Reply IDs as SIDH:SIDL, and the programmable buffer of each reply
+const int16 can_rtr_sid[N_CAN_RTR] = {
+    CAN_RTR_TABLE(EXPAND_AS_RTR_SID_ARRAY) };
+const int8 can_rtr_buffer[N_CAN_RTR] = {
+    CAN_RTR_TABLE(EXPAND_AS_RTR_BUFFER_ARRAY) };
+
+// Data last loaded into each reply buffer
+static int8  g_can_rtr_data[N_CAN_RTR][8];
+static int8  g_can_rtr_len[N_CAN_RTR];
+
+// Diagnostics
+static int16 g_can_rtr_reloads; // Reply buffers rewritten
+static int16 g_can_rtr_busy;    // Rewrites put off because a reply was going out
+
+// Sets up the reply buffers and their filters, called once the ECAN is in
+// mode 2. The replies start with no data until can_rtr_refresh() loads them.
+void can_rtr_init(void)
+{
+    int8 i;
+    int8 filter;
+    int8 n;
+    
+    g_can_rtr_reloads = 0;
+    g_can_rtr_busy    = 0;
+    
+    can_set_mode(CAN_OP_CONFIG);
+    
+    for (i = 0 ; i < N_CAN_RTR ; i++)
+    {
+        filter = CAN_RTR_FIRST_FILTER + i;
+        n = can_rtr_buffer[i];
+        
+        // Send remote frames for the reply ID to the reply buffer
+        can_set_sid((int8 *)can_rx_filter_addr[filter], can_rtr_sid[i]);
+        can_associate_filter_to_buffer(AB0 + n, filter);
+        
+        // Reply with the same ID
+        can_set_sid(CAN_B_ID(n), can_rtr_sid[i]);
+        *(CAN_B_CON(n) + CAN_B_DLC_OFFSET) = 0;
+        g_can_rtr_len[i] = 0;
+        
+        can_enable_rtr(1 << (n + 2)); // PROG_BUFFER bit of Bn
+    }
+    
+    RXFCON0 |= make8(CAN_RTR_FILTER_ENABLE, 0);
+    RXFCON1 |= make8(CAN_RTR_FILTER_ENABLE, 1);
+    
+    can_set_mode(CAN_OP_NORMAL);
+}
+
+// Loads a reply buffer if the data differs from what it holds, without
+// leaving normal mode. Returns false if a reply was going out, the buffer
+// is left as it was so call again later.
+int1 can_rtr_refresh(int8 reply, int8 *data, int8 len)
+{
+    int8 *con;
+    int8 *ptr;
+    int8 i;
+    int1 b_same;
+    
+    if (len > 8)
+    {
+        len = 8;
+    }
+    
+    b_same = (len == g_can_rtr_len[reply]);
+    for (i = 0 ; i < len ; i++)
+    {
+        if (data[i] != g_can_rtr_data[reply][i])
+        {
+            b_same = false;
+        }
+    }
+    if (b_same == true)
+    {
+        return true;
+    }
+    
+    // Stop answering while the buffer is written, unless a reply is
+    // already going out
+    con = CAN_B_CON(can_rtr_buffer[reply]);
+    *con &= ~CAN_B_RTREN;
+    if (*con & CAN_B_TXREQ)
+    {
+        *con |= CAN_B_RTREN;
+        g_can_rtr_busy++;
+        return false;
+    }
+    
+    ptr = con + CAN_B_DLC_OFFSET;
+    *ptr = len;
+    for (i = 0 ; i < len ; i++)
+    {
+        ptr++;
+        *ptr = data[i];
+        g_can_rtr_data[reply][i] = data[i];
+    }
+    g_can_rtr_len[reply] = len;
+    
+    *con |= CAN_B_RTREN;
+    g_can_rtr_reloads++;
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef CAN_RTR_H
+#define CAN_RTR_H
+
+// Replies to remote frames from the programmable buffers
+// Every entry of CAN_RTR_TABLE gets a buffer in auto-RTR mode and an
+// acceptance filter pointing at it, so the ECAN answers a remote frame with
+// the buffer contents without an interrupt. The main loop only rewrites a
+// buffer when its data changes.
+
+// Reply filters follow the CAN_MISC_TABLE filters
+#define CAN_RTR_FIRST_FILTER  CAN_RX_FILTERS_USED
+
+#if (CAN_RTR_FIRST_FILTER + N_CAN_RTR) > CAN_N_RX_FILTERS
+ #error Not enough acceptance filters for CAN_RTR_TABLE
+#endif
+
+// RXFCON1:RXFCON0 bits of the reply filters
+#define CAN_RTR_FILTER_ENABLE (((1 << N_CAN_RTR) - 1) << CAN_RTR_FIRST_FILTER)
+
+// Programmable buffer registers, Bn is 16 bytes after Bn-1
+#define CAN_B_STRIDE    0x10
+#define CAN_B_CON(n)    ((int8 *)(getenv("SFR:B0CON") + CAN_B_STRIDE * (n)))
+#define CAN_B_ID(n)     ((int8 *)(B0ID + CAN_B_STRIDE * (n)))
+#define CAN_B_DLC_OFFSET 5 // BnDLC from BnCON, the data bytes follow it
+#define CAN_B_RTREN     0x04
+#define CAN_B_TXREQ     0x08
+
+void can_rtr_init(void);
+int1 can_rtr_refresh(int8 reply, int8 *data, int8 len);
+
+#endif
@@ -0,0 +1,91 @@
+#include "can_rx_queue.h"
+
+static can_frame_t g_can_rx_queue[CAN_RX_QUEUE_SIZE];
+
+// Free running indices, only the producer writes the head and only the
+// consumer writes the tail. The number of queued frames is (head - tail).
+static int8  g_can_rx_head;
+static int8  g_can_rx_tail;
+
+// Diagnostics, written by the producer only
+static int8  g_can_rx_queue_hwm;   // Most frames queued at once
+static int16 g_can_rx_queue_drops; // Frames dropped because the queue was full
+
+void can_rx_queue_init(void)
+{
+    g_can_rx_head        = 0;
+    g_can_rx_tail        = 0;
+    g_can_rx_queue_hwm   = 0;
+    g_can_rx_queue_drops = 0;
+}
+
+// Adds a frame to the queue, called from the CAN receive interrupt
+// Returns false if the queue was full and the frame was dropped
+int1 can_rx_queue_push(int8 cmd, int8 *data, int8 len)
+{
+    can_frame_t *frame;
+    int8 count;
+    int8 i;
+    
+    count = g_can_rx_head - g_can_rx_tail;
+    if (count >= CAN_RX_QUEUE_SIZE)
+    {
+        g_can_rx_queue_drops++;
+        return false;
+    }
+    
+    // Data length codes above 8 still carry 8 bytes
+    if (len > 8)
+    {
+        len = 8;
+    }
+    
+    frame = &g_can_rx_queue[g_can_rx_head & CAN_RX_QUEUE_MASK];
+    frame->cmd = cmd;
+    frame->len = len;
+    for (i = 0 ; i < len ; i++)
+    {
+        frame->data[i] = data[i];
+    }
+    
+    // Publish the frame only once it is complete
+    g_can_rx_head++;
+    
+    count++;
+    if (count > g_can_rx_queue_hwm)
+    {
+        g_can_rx_queue_hwm = count;
+    }
+    return true;
+}
+
+// Removes the oldest frame from the queue, called from the main loop
+// Returns false if the queue was empty
+int1 can_rx_queue_pop(can_frame_t *frame)
+{
+    can_frame_t *slot;
+    int8 i;
+    
+    if (g_can_rx_tail == g_can_rx_head)
+    {
+        return false;
+    }
+    
+    slot = &g_can_rx_queue[g_can_rx_tail & CAN_RX_QUEUE_MASK];
+    frame->cmd = slot->cmd;
+    frame->len = slot->len;
+    for (i = 0 ; i < slot->len ; i++)
+    {
+        frame->data[i] = slot->data[i];
+    }
+    
+    // Release the slot only once it has been copied
+    g_can_rx_tail++;
+    return true;
+}
+
+// Returns true if no frame is waiting for the main loop
+int1 can_rx_queue_empty(void)
+{
+    return (g_can_rx_tail == g_can_rx_head);
+}
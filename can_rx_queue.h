@@ -0,0 +1,30 @@
+#ifndef CAN_RX_QUEUE_H
+#define CAN_RX_QUEUE_H
+
+// Single producer, single consumer queue of received CAN frames
+// The CAN receive interrupt pushes, the main loop pops. Each side only writes
+// its own 8 bit index, so no interrupt masking is needed.
+
+// Number of frames held by the queue, must be a power of 2 no larger than 128
+#ifndef CAN_RX_QUEUE_SIZE
+ #define CAN_RX_QUEUE_SIZE 8
+#endif
+#define CAN_RX_QUEUE_MASK (CAN_RX_QUEUE_SIZE - 1)
+
+#if (CAN_RX_QUEUE_SIZE & CAN_RX_QUEUE_MASK) != 0
+ #error CAN_RX_QUEUE_SIZE must be a power of 2
+#endif
+
+typedef struct
+{
+    int8 cmd;     // Index of the command in CAN_MISC_TABLE
+    int8 len;     // Number of data bytes
+    int8 data[8];
+} can_frame_t;
+
+void can_rx_queue_init(void);
+int1 can_rx_queue_push(int8 cmd, int8 *data, int8 len);
+int1 can_rx_queue_pop(can_frame_t *frame);
+int1 can_rx_queue_empty(void);
+
+#endif
@@ -8,19 +8,77 @@
 // CAN COMMAND DEFINES ///////
 //////////////////////////////
 
-#define EXPAND_AS_MISC_ID_ENUM(a,b)  a##_ID  = b,
+#define EXPAND_AS_MISC_ID_ENUM(a,b,c)      a##_ID    = b,
+#define EXPAND_AS_MISC_INDEX_ENUM(a,b,c)   a##_INDEX,
+#define EXPAND_AS_MISC_ID_ARRAY(a,b,c)     b,
+#define EXPAND_AS_MISC_HANDLER_ARRAY(a,b,c) c,
+#define EXPAND_AS_MISC_SID_ARRAY(a,b,c)    CAN_STD_SID16(b),
+#define EXPAND_AS_MISC_ID_CHECK(a,b,c)     typedef int8 a##_ID_CHECK[((b) == CAN_MISC_BASE_ID + a##_INDEX) ? 1 : -1];
 
 // X macro table of miscellaneous CANbus packets
-//        Packet name                  ,    ID
-#define CAN_MISC_TABLE(ENTRY)                   \
-    ENTRY(COMMAND_LEFT_SIGNAL          , 0x300) \
-    ENTRY(COMMAND_RIGHT_SIGNAL         , 0x301) \
-    ENTRY(COMMAND_HAZARD_SIGNAL        , 0x302) \
-    ENTRY(COMMAND_BPS_TRIP_SIGNAL      , 0x303) \
-    ENTRY(COMMAND_PMS_BRAKE_LIGHT      , 0x304)
-#define N_CAN_COMMAND 5
+// IDs must be consecutive, starting at CAN_MISC_BASE_ID
+// COMMAND_IDLE_PARK is new with this blinker, the car controller has to send
+// it once the car is parked. Until it does, the blinker never idle parks.
+//        Packet name                  ,    ID, Handler
+#define CAN_MISC_TABLE(ENTRY)                                        \
+    ENTRY(COMMAND_LEFT_SIGNAL          , 0x300, can_cmd_left_signal)   \
+    ENTRY(COMMAND_RIGHT_SIGNAL         , 0x301, can_cmd_right_signal)  \
+    ENTRY(COMMAND_HAZARD_SIGNAL        , 0x302, can_cmd_hazard_signal) \
+    ENTRY(COMMAND_BPS_TRIP_SIGNAL      , 0x303, can_cmd_bps_trip)      \
+    ENTRY(COMMAND_PMS_BRAKE_LIGHT      , 0x304, can_cmd_brake_light)   \
+    ENTRY(COMMAND_IDLE_PARK            , 0x305, can_cmd_idle_park)
+#define N_CAN_COMMAND    6
+#define CAN_MISC_BASE_ID 0x300
 
 enum {CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ENUM)};
+enum {CAN_MISC_TABLE(EXPAND_AS_MISC_INDEX_ENUM)};
+
+// Commands are dispatched by (ID - CAN_MISC_BASE_ID), an entry whose ID doesn't
+// match its position declares a negative sized array and stops the build
+CAN_MISC_TABLE(EXPAND_AS_MISC_ID_CHECK)
+
+//////////////////////////////
+// CAN TELEMETRY DEFINES /////
+//////////////////////////////
+
+// Light status frame sent by the blinker, 8 data bytes
+//   0   Lamp outputs, LATA bits
+//   1   Debounced switches, PORTB bits
+//   2   Signal flags, lamp_logic input bits
+//   3   Status flags, STATUS_FLAG_* bits
+//   4   Sequence number, incremented per frame
+//   5   CAN receive queue drops, saturating
+//   6-7 CAN receive FIFO overflows, big endian
+#define TELEM_BLINKER_STATUS_ID  0x310
+#define TELEM_BLINKER_STATUS_LEN 8
+
+#define STATUS_FLAG_BLINK_PHASE  0x01 // Turn signals are in the lit half period
+#define STATUS_FLAG_STROBE       0x02 // Strobe is running
+#define STATUS_FLAG_STROBE_PHASE 0x04 // Strobe is lit
+#define STATUS_FLAG_BPS_TRIP     0x08 // BPS has tripped
+
+#define EXPAND_AS_RTR_INDEX_ENUM(a,b,c)   a##_INDEX,
+#define EXPAND_AS_RTR_SID_ARRAY(a,b,c)    CAN_STD_SID16(b),
+#define EXPAND_AS_RTR_BUFFER_ARRAY(a,b,c) c,
+
+// X macro table of replies to remote frames, sent by the ECAN without the CPU
+// Each reply has its own programmable buffer (0-5 for B0-B5)
+//   TELEM_RTR_STATUS   Same 8 bytes as TELEM_BLINKER_STATUS_ID
+//   TELEM_RTR_COUNTERS 8 bytes, big endian 16 bit counters
+//                        0-1 CAN receive FIFO overflows
+//                        2-3 CAN receive queue drops
+//                        4-5 CAN transmit queue drops
+//                        6-7 Status frames not queued
+//   TELEM_RTR_FIRMWARE 8 bytes, "BLNK" then the firmware version major,
+//                      minor, patch and the telemetry layout version
+//        Packet name                  ,    ID, Buffer
+#define CAN_RTR_TABLE(ENTRY)                              \
+    ENTRY(TELEM_RTR_STATUS             , 0x311, 0)        \
+    ENTRY(TELEM_RTR_COUNTERS           , 0x312, 1)        \
+    ENTRY(TELEM_RTR_FIRMWARE           , 0x313, 2)
+#define N_CAN_RTR 3
+
+enum {CAN_RTR_TABLE(EXPAND_AS_RTR_INDEX_ENUM)};
 
 
 #endif
@@ -0,0 +1,205 @@
+#include "can_tx_queue.h"
+#include "timebase.h"
+
+static can_tx_frame_t g_can_tx_queue[CAN_TX_N_PRIORITIES][CAN_TX_QUEUE_SIZE];
+
+// Free running indices per priority, only the main loop writes the heads and
+// only the refill writes the tails
+static int8  g_can_tx_head[CAN_TX_N_PRIORITIES];
+static int8  g_can_tx_tail[CAN_TX_N_PRIORITIES];
+
+// Push time of the frame loaded in each transmit buffer
+static int32 g_can_tx_stamp[CAN_TX_N_BUFFERS];
+
+// Diagnostics
+static int8  g_can_tx_queue_hwm;    // Most frames queued at once
+static int16 g_can_tx_queue_drops;  // Frames dropped because their ring was full
+static int32 g_can_tx_latency;      // Push to transmit complete of the last frame, in instruction cycles
+static int32 g_can_tx_latency_max;  // Longest push to transmit complete, in instruction cycles
+
+// Returns the number of frames waiting for a transmit buffer
+int8 can_tx_queue_depth(void)
+{
+    int8 depth;
+    int8 pri;
+    
+    depth = 0;
+    for (pri = 0 ; pri < CAN_TX_N_PRIORITIES ; pri++)
+    {
+        depth += g_can_tx_head[pri] - g_can_tx_tail[pri];
+    }
+    return depth;
+}
+
+// Loads one transmit buffer, returns false if it is still busy
+int1 can_tx_load(int8 buffer, can_tx_frame_t *frame, int8 pri)
+{
+    int1 b_loaded;
+    
+    switch (buffer)
+    {
+        case 0:
+            b_loaded = can_t0_putd(frame->id, frame->data, frame->len, pri, false, false);
+            break;
+        case 1:
+            b_loaded = can_t1_putd(frame->id, frame->data, frame->len, pri, false, false);
+            break;
+        default:
+            b_loaded = can_t2_putd(frame->id, frame->data, frame->len, pri, false, false);
+            break;
+    }
+    if (b_loaded == true)
+    {
+        g_can_tx_stamp[buffer] = frame->stamp;
+    }
+    return b_loaded;
+}
+
+// Moves queued frames into the free transmit buffers, highest priority first
+// Only called from the transmit interrupt, so the driver's putd and set_id
+// functions are never shared with the main loop
+void can_tx_queue_refill(void)
+{
+    can_tx_frame_t *frame;
+    int8 buffer;
+    int8 pri;
+    
+    buffer = 0;
+    pri = CAN_TX_N_PRIORITIES - 1;
+    while (true)
+    {
+        if (g_can_tx_tail[pri] != g_can_tx_head[pri])
+        {
+            // Load the oldest frame of this priority into the next free buffer
+            frame = &g_can_tx_queue[pri][g_can_tx_tail[pri] & CAN_TX_QUEUE_MASK];
+            while ((buffer < CAN_TX_N_BUFFERS) && (can_tx_load(buffer, frame, pri) == false))
+            {
+                buffer++;
+            }
+            if (buffer >= CAN_TX_N_BUFFERS)
+            {
+                // Every buffer is busy, the interrupt refills them
+                return;
+            }
+            
+            // Release the slot only once it has been loaded
+            g_can_tx_tail[pri]++;
+            buffer++;
+        }
+        else if (pri == 0)
+        {
+            return;
+        }
+        else
+        {
+            pri--;
+        }
+    }
+}
+
+// Records the latency of a sent frame
+void can_tx_done(int8 buffer)
+{
+    g_can_tx_latency = timebase_now_isr() - g_can_tx_stamp[buffer];
+    if (g_can_tx_latency > g_can_tx_latency_max)
+    {
+        g_can_tx_latency_max = g_can_tx_latency;
+    }
+}
+
+// CAN transmit complete interrupt
+// In mode 2 this is TXBnIF, set when any buffer enabled in TXBIE has been
+// sent. TXBnCON.txbif tells which ones. can_tx_queue_push also sets it to
+// have a new frame loaded. The flag is cleared before the buffers are looked
+// at, so a buffer that finishes during the refill raises it again.
+#int_cantx2 NOCLEAR
+void isr_cantx(void)
+{
+    clear_interrupt(INT_CANTX2);
+    
+    if (TXB0CON_MODE_2.txbif)
+    {
+        TXB0CON_MODE_2.txbif = 0;
+        can_tx_done(0);
+    }
+    if (TXB1CON_MODE_2.txbif)
+    {
+        TXB1CON_MODE_2.txbif = 0;
+        can_tx_done(1);
+    }
+    if (TXB2CON_MODE_2.txbif)
+    {
+        TXB2CON_MODE_2.txbif = 0;
+        can_tx_done(2);
+    }
+    
+    can_tx_queue_refill();
+}
+
+// Called once the ECAN is in mode 2
+void can_tx_queue_init(void)
+{
+    int8 pri;
+    
+    for (pri = 0 ; pri < CAN_TX_N_PRIORITIES ; pri++)
+    {
+        g_can_tx_head[pri] = 0;
+        g_can_tx_tail[pri] = 0;
+    }
+    g_can_tx_queue_hwm    = 0;
+    g_can_tx_queue_drops  = 0;
+    g_can_tx_latency      = 0;
+    g_can_tx_latency_max  = 0;
+    
+    txbie.txb0ie = 1;
+    txbie.txb1ie = 1;
+    txbie.txb2ie = 1;
+    clear_interrupt(INT_CANTX2);
+    enable_interrupts(INT_CANTX2);
+}
+
+// Queues a frame with a standard ID and has the transmit interrupt load it.
+// Priority 3 goes first. Called from the main loop.
+// Returns false if the ring for that priority was full and the frame was dropped
+int1 can_tx_queue_push(int16 id, int8 *data, int8 len, int8 priority)
+{
+    can_tx_frame_t *frame;
+    int8 depth;
+    int8 i;
+    
+    priority &= CAN_TX_N_PRIORITIES - 1;
+    
+    if ((int8)(g_can_tx_head[priority] - g_can_tx_tail[priority]) >= CAN_TX_QUEUE_SIZE)
+    {
+        g_can_tx_queue_drops++;
+        return false;
+    }
+    
+    if (len > 8)
+    {
+        len = 8;
+    }
+    
+    frame = &g_can_tx_queue[priority][g_can_tx_head[priority] & CAN_TX_QUEUE_MASK];
+    frame->id    = id;
+    frame->len   = len;
+    frame->stamp = timebase_now();
+    for (i = 0 ; i < len ; i++)
+    {
+        frame->data[i] = data[i];
+    }
+    
+    // Publish the frame only once it is complete
+    g_can_tx_head[priority]++;
+    
+    depth = can_tx_queue_depth();
+    if (depth > g_can_tx_queue_hwm)
+    {
+        g_can_tx_queue_hwm = depth;
+    }
+    
+    // Raise the transmit interrupt to load the frame if a buffer is free,
+    // a single bit set so it can't clash with the interrupt clearing it
+    CAN_INT_TXB2IF = 1; // TXBnIF in mode 2
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef CAN_TX_QUEUE_H
+#define CAN_TX_QUEUE_H
+
+// Prioritised queue of CAN frames to send
+// The main loop pushes, TXB0-TXB2 are only refilled from the transmit complete
+// interrupt. There is one ring per priority and a buffer always takes the
+// frame from the highest priority ring that isn't empty, so pushing and
+// refilling take the same time however full the queue is. The priority is
+// also loaded into TXBnCON.txpri, so loaded buffers go out in priority order.
+//
+// B0-B5 are not used, they are left for other uses such as auto-RTR replies.
+
+// Frames held per priority, must be a power of 2 no larger than 128
+#ifndef CAN_TX_QUEUE_SIZE
+ #define CAN_TX_QUEUE_SIZE 4
+#endif
+#define CAN_TX_QUEUE_MASK (CAN_TX_QUEUE_SIZE - 1)
+
+#if (CAN_TX_QUEUE_SIZE & CAN_TX_QUEUE_MASK) != 0
+ #error CAN_TX_QUEUE_SIZE must be a power of 2
+#endif
+
+#define CAN_TX_N_PRIORITIES 4 // TXBnCON.txpri 0-3, 3 goes first
+#define CAN_TX_N_BUFFERS    3 // TXB0-TXB2
+
+typedef struct
+{
+    int16 id;     // Standard ID
+    int8  len;    // Number of data bytes
+    int8  data[8];
+    int32 stamp;  // timebase_now() when the frame was pushed
+} can_tx_frame_t;
+
+void can_tx_queue_init(void);
+int1 can_tx_queue_push(int16 id, int8 *data, int8 len, int8 priority);
+int8 can_tx_queue_depth(void);
+
+#endif
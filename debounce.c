@@ -0,0 +1,204 @@
+#include "debounce.h"
+
+static int8 g_debounce_ct0;    // Vertical counter, bit 0
+static int8 g_debounce_ct1;    // Vertical counter, bit 1
+static int8 g_debounce_ticks;  // Ticks until the next sample
+static int1 gb_debounce_busy;  // Set while a switch is settling
+static int8 g_switch_state;    // Debounced state, bit n is PORTB bit n
+static int8 g_switch_reported; // State last returned by debounce_read
+
+// Latency from the first pin change to the debounced edge, in ticks
+static int8 g_debounce_elapsed;
+static int8 g_debounce_latency;
+static int8 g_debounce_latency_max;
+
+// Starts sampling, called when a switch pin changes
+void debounce_wake(void)
+{
+    if (gb_debounce_busy == false)
+    {
+        gb_debounce_busy   = true;
+        g_debounce_ticks   = 0;
+        g_debounce_elapsed = 0;
+    }
+}
+
+// Sets each external interrupt to catch its pin leaving the debounced state,
+// called from debounce_tick once sampling goes idle
+void debounce_arm_edges(void)
+{
+    if (bit_test(g_switch_state, LEFT_IN_PIN & 7))
+    {
+        ext_int_edge(0, H_TO_L);
+    }
+    else
+    {
+        ext_int_edge(0, L_TO_H);
+    }
+    
+    if (bit_test(g_switch_state, RIGHT_IN_PIN & 7))
+    {
+        ext_int_edge(1, H_TO_L);
+    }
+    else
+    {
+        ext_int_edge(1, L_TO_H);
+    }
+    
+    if (bit_test(g_switch_state, HAZARD_IN_PIN & 7))
+    {
+        ext_int_edge(2, H_TO_L);
+    }
+    else
+    {
+        ext_int_edge(2, L_TO_H);
+    }
+    
+    // Changing the edge can set the flag, edges from bouncing are stale too
+    clear_interrupt(INT_EXT);
+    clear_interrupt(INT_EXT1);
+    clear_interrupt(INT_EXT2);
+}
+
+// Left switch, RB0
+#int_ext
+void isr_switch_int0(void)
+{
+    debounce_wake();
+}
+
+// Right switch, RB1
+#int_ext1
+void isr_switch_int1(void)
+{
+    debounce_wake();
+}
+
+// Hazard switch, RB2
+#int_ext2
+void isr_switch_int2(void)
+{
+    debounce_wake();
+}
+
+// Regen and mechanical brake switches, RB4-RB5
+#int_rb
+void isr_switch_ioc(void)
+{
+    int8 dummy;
+    
+    // Reading the port ends the mismatch condition
+    dummy = PORTB;
+    debounce_wake();
+}
+
+void debounce_init(void)
+{
+    int8 dummy;
+    
+    g_debounce_ct0         = 0;
+    g_debounce_ct1         = 0;
+    g_switch_state         = 0;
+    g_switch_reported      = 0;
+    g_debounce_latency     = 0;
+    g_debounce_latency_max = 0;
+    
+    // Sample once at startup in case a switch is already on. This is set up
+    // here rather than through debounce_wake and debounce_arm_edges, which the
+    // interrupts use, so CCS doesn't mask interrupts around them.
+    gb_debounce_busy   = true;
+    g_debounce_ticks   = 0;
+    g_debounce_elapsed = 0;
+    
+    // Every switch starts off, debounce_tick re-arms once sampling goes idle
+    ext_int_edge(0, L_TO_H);
+    ext_int_edge(1, L_TO_H);
+    ext_int_edge(2, L_TO_H);
+    IOCB = DEBOUNCE_IOC_MASK;
+    dummy = PORTB;
+    
+    clear_interrupt(INT_EXT);
+    clear_interrupt(INT_EXT1);
+    clear_interrupt(INT_EXT2);
+    clear_interrupt(INT_RB);
+    enable_interrupts(INT_EXT);
+    enable_interrupts(INT_EXT1);
+    enable_interrupts(INT_EXT2);
+    enable_interrupts(INT_RB);
+}
+
+// Samples every switch, called from the timer interrupt once per tick
+void debounce_tick(void)
+{
+    int8 delta;
+    int8 toggle;
+    
+    if (gb_debounce_busy == false)
+    {
+        // Nothing moved, nothing to do
+        return;
+    }
+    
+    g_debounce_elapsed++;
+    if (g_debounce_ticks > 0)
+    {
+        g_debounce_ticks--;
+        return;
+    }
+    g_debounce_ticks = DEBOUNCE_SAMPLE_MS - 1;
+    
+    // Counters of switches that agree with their state are held at zero,
+    // the others count and flip the state when they wrap
+    delta = (PORTB & SWITCH_MASK) ^ g_switch_state;
+    g_debounce_ct1 = (g_debounce_ct1 ^ g_debounce_ct0) & delta;
+    g_debounce_ct0 = ~g_debounce_ct0 & delta;
+    toggle = delta & ~(g_debounce_ct0 | g_debounce_ct1);
+    g_switch_state ^= toggle;
+    
+    if (toggle != 0)
+    {
+        g_debounce_latency = g_debounce_elapsed;
+        if (g_debounce_latency > g_debounce_latency_max)
+        {
+            g_debounce_latency_max = g_debounce_latency;
+        }
+    }
+    
+    if (delta == 0)
+    {
+        // Every switch agrees with its state and all counters are clear.
+        // Arm the edges from the debounced state, then look at the pins
+        // again: a switch that moved before the edges were armed keeps
+        // the debouncer sampling instead of being missed.
+        debounce_arm_edges();
+        if (((PORTB & SWITCH_MASK) ^ g_switch_state) == 0)
+        {
+            gb_debounce_busy = false;
+        }
+    }
+}
+
+// Returns the debounced switch state, bit n is PORTB bit n
+// edges is set to the switches that changed since the last call
+int8 debounce_read(int8 *edges)
+{
+    int8 state;
+    
+    // Single byte read, the interrupt can't tear it
+    state = g_switch_state;
+    *edges = state ^ g_switch_reported;
+    g_switch_reported = state;
+    return state;
+}
+
+// Returns the debounced switch state without taking the edges
+int8 debounce_state(void)
+{
+    return g_switch_state;
+}
+
+// Returns true while a switch is settling
+int1 debounce_busy(void)
+{
+    return gb_debounce_busy;
+}
@@ -0,0 +1,35 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+// Switch debouncing driven by the 1ms timer tick
+// PORTB is read once per sample and all switches are debounced together with
+// 2 bit vertical counters, one counter bit per byte. A switch only changes
+// state after DEBOUNCE_SAMPLES consecutive samples disagree with it.
+//
+// Sampling only runs after a switch moves. RB0-RB2 wake the debouncer through
+// INT0-INT2, RB4-RB5 through interrupt-on-change. Once every switch agrees
+// with its debounced state the debouncer goes idle again.
+
+#ifndef DEBOUNCE_PERIOD_MS
+ #define DEBOUNCE_PERIOD_MS 10
+#endif
+
+// Samples needed to change state, fixed by the 2 bit counters
+#define DEBOUNCE_SAMPLES   4
+
+// Ticks between samples, rounded up so the period is at least DEBOUNCE_PERIOD_MS
+#define DEBOUNCE_SAMPLE_MS ((DEBOUNCE_PERIOD_MS + DEBOUNCE_SAMPLES - 1) / DEBOUNCE_SAMPLES)
+
+// Switches that use interrupt-on-change instead of an external interrupt
+#define DEBOUNCE_IOC_MASK  (SWITCH_MASK & 0xF0)
+
+#byte PORTB = getenv("SFR:PORTB")
+#byte IOCB  = getenv("SFR:IOCB")
+
+void debounce_init(void);
+void debounce_tick(void);
+int8 debounce_read(int8 *edges);
+int8 debounce_state(void);
+int1 debounce_busy(void);
+
+#endif
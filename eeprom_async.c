@@ -0,0 +1,94 @@
+#include "eeprom_async.h"
+
+// Pending writes, oldest first. Entry 0 is being programmed while
+// gb_eeprom_writing is set.
+static eeprom_write_t g_eeprom_queue[EEPROM_QUEUE_SIZE];
+static int8           g_eeprom_count;
+static int1           gb_eeprom_writing;
+
+void eeprom_async_init(void)
+{
+    g_eeprom_count    = 0;
+    gb_eeprom_writing = false;
+}
+
+// Queues a write, a pending write to the same address is replaced instead
+// Returns false if the queue is full
+int1 eeprom_write_async(int16 addr, int8 data)
+{
+    int8 i;
+    
+    // Entry 0 can't be changed once it is being programmed
+    i = (gb_eeprom_writing == true) ? 1 : 0;
+    for ( ; i < g_eeprom_count ; i++)
+    {
+        if (g_eeprom_queue[i].addr == addr)
+        {
+            g_eeprom_queue[i].data = data;
+            return true;
+        }
+    }
+    
+    if (g_eeprom_count >= EEPROM_QUEUE_SIZE)
+    {
+        return false;
+    }
+    
+    g_eeprom_queue[g_eeprom_count].addr = addr;
+    g_eeprom_queue[g_eeprom_count].data = data;
+    g_eeprom_count++;
+    return true;
+}
+
+// Starts programming entry 0 of the queue
+void eeprom_start_write(void)
+{
+    EEADR  = make8(g_eeprom_queue[0].addr, 0);
+    EEADRH = make8(g_eeprom_queue[0].addr, 1);
+    EEDATA = g_eeprom_queue[0].data;
+    EECON1 = 0x04; // Data EEPROM, write enabled
+    
+    // The unlock sequence must not be interrupted
+    disable_interrupts(GLOBAL);
+    EECON2 = 0x55;
+    EECON2 = 0xAA;
+    EECON1_WR = 1;
+    enable_interrupts(GLOBAL);
+    
+    EECON1_WREN = 0;
+    gb_eeprom_writing = true;
+}
+
+// Retires a finished write and starts the next one
+void eeprom_service(void)
+{
+    int8 i;
+    
+    if (gb_eeprom_writing == true)
+    {
+        if (EECON1_WR == 1)
+        {
+            // Still programming
+            return;
+        }
+        
+        // Remove the finished write from the queue
+        gb_eeprom_writing = false;
+        g_eeprom_count--;
+        for (i = 0 ; i < g_eeprom_count ; i++)
+        {
+            g_eeprom_queue[i] = g_eeprom_queue[i + 1];
+        }
+    }
+    
+    if (g_eeprom_count > 0)
+    {
+        eeprom_start_write();
+    }
+}
+
+// Returns true while writes are pending or being programmed
+int1 eeprom_busy(void)
+{
+    return (g_eeprom_count > 0);
+}
@@ -0,0 +1,33 @@
+#ifndef EEPROM_ASYNC_H
+#define EEPROM_ASYNC_H
+
+// Non-blocking data EEPROM writer
+// Writes are queued by eeprom_write_async and programmed one at a time by
+// eeprom_service, which must be called regularly from the main loop. A write
+// takes several milliseconds, during which the CPU keeps running.
+
+// Number of writes that can be pending at once
+#ifndef EEPROM_QUEUE_SIZE
+ #define EEPROM_QUEUE_SIZE 4
+#endif
+
+#byte EECON1 = getenv("SFR:EECON1")
+#byte EECON2 = getenv("SFR:EECON2")
+#byte EEDATA = getenv("SFR:EEDATA")
+#byte EEADR  = getenv("SFR:EEADR")
+#byte EEADRH = getenv("SFR:EEADRH")
+#bit  EECON1_WR   = getenv("BIT:WR")
+#bit  EECON1_WREN = getenv("BIT:WREN")
+
+typedef struct
+{
+    int16 addr;
+    int8  data;
+} eeprom_write_t;
+
+void eeprom_async_init(void);
+int1 eeprom_write_async(int16 addr, int8 data);
+void eeprom_service(void);
+int1 eeprom_busy(void);
+
+#endif
@@ -0,0 +1,18 @@
+#include "lamp_logic.h"
+
+#define LAMP_ROW(n)                                      \
+    LAMP_LOGIC((n) + 0), LAMP_LOGIC((n) + 1), LAMP_LOGIC((n) + 2), LAMP_LOGIC((n) + 3), \
+    LAMP_LOGIC((n) + 4), LAMP_LOGIC((n) + 5), LAMP_LOGIC((n) + 6), LAMP_LOGIC((n) + 7)
+
+// Lamp pattern for every input combination, indexed by the packed input byte
+const int8 g_lamp_table[LAMP_N_STATES] =
+{
+    LAMP_ROW(0),  LAMP_ROW(8),  LAMP_ROW(16), LAMP_ROW(24),
+    LAMP_ROW(32), LAMP_ROW(40), LAMP_ROW(48), LAMP_ROW(56)
+};
+
+// Returns the lamp bits of LATA for the packed inputs
+int8 lamp_logic(int8 inputs)
+{
+    return g_lamp_table[inputs & (LAMP_N_STATES - 1)];
+}
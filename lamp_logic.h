@@ -0,0 +1,41 @@
+#ifndef LAMP_LOGIC_H
+#define LAMP_LOGIC_H
+
+// Light logic as a truth table
+// The inputs are packed into one byte and the lamp pattern is looked up in a
+// table generated at compile time, so every evaluation takes the same time.
+// LAMP_LOGIC() only uses the preprocessor, a host build can include this
+// header with the pin definitions and check every entry against it.
+
+// Bits of the packed input byte
+#define LAMP_IN_LEFT     0
+#define LAMP_IN_RIGHT    1
+#define LAMP_IN_HAZARD   2
+#define LAMP_IN_REGEN    3
+#define LAMP_IN_MECH     4
+#define LAMP_IN_BPS_TRIP 5
+#define LAMP_N_STATES    64 // 2^6 input combinations
+
+// Lamp bits of LATA, the lamps are only ever written through lamp_commit()
+#define LAMP_BIT(pin) (1 << ((pin) & 7))
+#define TURN_MASK     (LAMP_BIT(LEFT_OUT_PIN) | LAMP_BIT(RIGHT_OUT_PIN))
+#define LAMP_MASK     (TURN_MASK | LAMP_BIT(BRAKE_OUT_PIN) | LAMP_BIT(STROBE_OUT_PIN))
+
+#define LAMP_IN(s,b) (((s) >> (b)) & 1)
+
+// Turn signal bits blink, the other bits are steady
+// BPS trip overrides everything, the strobe is driven separately
+// Hazard overrides the turn signals
+// Brake = regen || mech
+#define LAMP_TURN(s)                                              \
+    (LAMP_IN(s, LAMP_IN_HAZARD) ? TURN_MASK :                     \
+     ((LAMP_IN(s, LAMP_IN_LEFT)  ? LAMP_BIT(LEFT_OUT_PIN)  : 0) | \
+      (LAMP_IN(s, LAMP_IN_RIGHT) ? LAMP_BIT(RIGHT_OUT_PIN) : 0)))
+#define LAMP_BRAKE(s)                                             \
+    ((LAMP_IN(s, LAMP_IN_REGEN) | LAMP_IN(s, LAMP_IN_MECH)) ? LAMP_BIT(BRAKE_OUT_PIN) : 0)
+#define LAMP_LOGIC(s)                                             \
+    (LAMP_IN(s, LAMP_IN_BPS_TRIP) ? 0 : (LAMP_TURN(s) | LAMP_BRAKE(s)))
+
+int8 lamp_logic(int8 inputs);
+
+#endif
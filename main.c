@@ -1,366 +1,863 @@
 #include "main.h"
 #include "can_telem.h"
+
 #include "can18F4580_mscp.c"
 
+// The receive FIFO drain, the transmit queue and the auto-RTR replies only
+// work in mode 2
+#if CAN_FUNCTIONAL_MODE != 2
+ #error CAN_FUNCTIONAL_MODE must be 2 for the blinker
+#endif
+
+#include "can_rx_queue.c"
+#include "eeprom_async.c"
+#include "debounce.c"
+#include "scheduler.c"
+#include "can_tx_queue.c"
+#include "can_rtr.c"
+#include "timebase.c"
+#include "lamp_logic.c"
+
 // Timing periods
 #define BLINK_PERIOD_MS         500
 #define STROBE_PERIOD_MS         50
-#define DEBOUNCE_PERIOD_MS       10 // Hardware switch debounce period
 #define POWER_RESET_TIMEOUT_MS 2000 // Power reset timeout after a bps trip
+#define IDLE_PARK_CHECK_MS      100 // Period of the idle park request check
+#define STATUS_MIN_GAP_MS        20 // Shortest time between status frames
+#define STATUS_KEEPALIVE_MS    1000 // Status frame period while nothing changes
+#define STATUS_PRIORITY           1 // Transmit priority of the status frame (0-3)
+#define RTR_REFRESH_MS           10 // How often the remote frame replies are refreshed
+
+// Firmware identity, answered to TELEM_RTR_FIRMWARE remote frames
+#define FIRMWARE_VERSION_MAJOR 1
+#define FIRMWARE_VERSION_MINOR 0
+#define FIRMWARE_VERSION_PATCH 0
+#define TELEM_LAYOUT_VERSION   1 // Bump when a frame layout in can_telem.h changes
+
+// Blink edge timing
+#define BLINK_PERIOD_CYCLES ((int32)BLINK_PERIOD_MS * SCHED_TICK_CYCLES)
+#define BLINK_JITTER_EDGES  64   // Blink edges per jitter measurement
+#define JITTER_CHECK_MS     100  // How often edge periods are picked up, under BLINK_PERIOD_MS
+
+#byte LATA = getenv("SFR:LATA")
+
+// Signal flag masks of g_signals
+#define SIGNAL_LEFT     (1 << LAMP_IN_LEFT)
+#define SIGNAL_RIGHT    (1 << LAMP_IN_RIGHT)
+#define SIGNAL_HAZARD   (1 << LAMP_IN_HAZARD)
+#define SIGNAL_REGEN    (1 << LAMP_IN_REGEN)
+#define SIGNAL_MECH     (1 << LAMP_IN_MECH)
+#define SIGNAL_BPS_TRIP (1 << LAMP_IN_BPS_TRIP)
+
+// CAN receive options
+#define CAN_RX_DISPATCH_FILTHIT TRUE // Dispatch on the filter hit instead of the ID
+#define CAN_RX_PROFILE          TRUE // Count instruction cycles spent per frame
+#define MAIN_LOOP_PROFILE       TRUE // Count instruction cycles spent per main loop pass
 
 #define EEPROM_ADDRESS   0x00
 #define BPS_SUCCESS_FLAG 0x00
 #define BPS_TRIP_FLAG    0x01
 
-// Debounces a hardware pin
-#define DEBOUNCE                               \
-    int16 i;                                   \
-    for (i = 0 ; i < DEBOUNCE_PERIOD_MS ; i++) \
-    {                                          \
-        delay_ms(1);                           \
-    }
+// Signal flags, packed in the lamp_logic input layout so the byte indexes the
+// truth table directly. Each flag is a bit of g_signals, so setting, clearing
+// or toggling one is a single instruction. Only the main loop writes them.
+static int8            g_signals;
+#bit gb_left_sig   = g_signals.LAMP_IN_LEFT
+#bit gb_right_sig  = g_signals.LAMP_IN_RIGHT
+#bit gb_hazard_sig = g_signals.LAMP_IN_HAZARD
+#bit gb_regen_sig  = g_signals.LAMP_IN_REGEN
+#bit gb_mech_sig   = g_signals.LAMP_IN_MECH
+#bit gb_bps_trip   = g_signals.LAMP_IN_BPS_TRIP
 
-static int1            gb_left_sig;
-static int1            gb_right_sig;
-static int1            gb_hazard_sig;
-static int1            gb_regen_sig;
-static int1            gb_mech_sig;
-static int1            gb_bps_trip;
-static int1            gb_blink;
-static blinker_state_t g_state;
+static int1            gb_strobe;          // Strobe flashing, driven by the timer interrupt
+static int1            gb_strobe_phase;    // Strobe is lit in this half period
+static int8            g_lamp_steady;      // Steady lamp bits of LATA, written by main
+static int1            gb_blink_phase;     // Turn signals are lit in this half period
+static int8            g_blink_word;       // Turn signal bits of LATA lit in the on phase
+static int1            gb_blink_restart;   // Start an on phase on the next tick
+static int8            g_lamp_next;        // Lamp bits of LATA written at the start of the next tick
+static int1            gb_blink_edge;      // g_lamp_next holds a blink edge
+
+// Blink edge period over the last BLINK_JITTER_EDGES edges, in instruction cycles
+static int32           g_blink_period_min;
+static int32           g_blink_period_max;
+static int16           g_blink_period_stddev;
+static int32           g_blink_edge_period;   // Last edge to edge period, set by the timer interrupt
+static int1            gb_blink_period_valid; // The last edge time is a regular edge
+static int1            gb_blink_period_ready; // Set by the timer interrupt, cleared by jitter_task
+
+static int16           g_can_rx_overflows; // Number of CAN receive FIFO overflows
+static int8            g_status_seq;       // Sequence number of the next status frame
+static int16           g_status_tx_fails;  // Status frames dropped, transmit queue full
+static int16           g_status_gap_ms;    // Time since the last status frame
+static int16           g_status_event_frames;     // Frames sent because the state changed
+static int16           g_status_keepalive_frames; // Frames sent because nothing changed
+#if CAN_RX_PROFILE
+static int16           g_can_rx_cycles;     // Cycles spent on the last frame
+static int16           g_can_rx_cycles_max; // Most cycles spent on a frame
+#endif
+#if MAIN_LOOP_PROFILE
+static int16           g_loop_cycles_max;   // Most cycles spent on a main loop pass
+#endif
+static int1            gb_can_rx_activity;  // Set when a frame is received
+static int1            gb_idle_park_request; // COMMAND_IDLE_PARK received
+static int16           g_idle_park_count;   // Number of idle parks
 
 void blinker_init(void)
 {
-    gb_left_sig      = false;
-    gb_right_sig     = false;
-    gb_hazard_sig    = false;
-    gb_regen_sig     = false;
-    gb_mech_sig      = false;
-    gb_bps_trip    = false;
+    g_signals      = 0;
+    gb_strobe      = false;
+    gb_strobe_phase = false;
+    g_lamp_steady  = 0;
+    gb_blink_phase = false;
+    g_blink_word   = 0;
+    gb_blink_restart = false;
+    g_lamp_next    = 0;
+    gb_blink_edge  = false;
+    
+    g_blink_period_min    = 0;
+    g_blink_period_max    = 0;
+    g_blink_period_stddev = 0;
+    gb_blink_period_ready = false;
+    gb_blink_period_valid = false;
     
-    // Turn off all lights on startup
+    g_can_rx_overflows = 0;
+    g_status_seq       = 0;
+    g_status_tx_fails  = 0;
+    g_status_gap_ms    = 0;
+    g_status_event_frames     = 0;
+    g_status_keepalive_frames = 0;
+    gb_can_rx_activity = false;
+    gb_idle_park_request = false;
+    g_idle_park_count  = 0;
+    can_rx_queue_init();
+    eeprom_async_init();
+    debounce_init();
+    sched_init();
+#if MAIN_LOOP_PROFILE
+    g_loop_cycles_max = 0;
+#endif
+#if CAN_RX_PROFILE
+    g_can_rx_cycles     = 0;
+    g_can_rx_cycles_max = 0;
+#endif
+    
+    // Turn off all lights on startup, this also makes the lamp pins outputs
     output_low(LEFT_OUT_PIN);
     output_low(RIGHT_OUT_PIN);
     output_low(BRAKE_OUT_PIN);
     output_low(STROBE_OUT_PIN);
 }
 
-#int_timer2
-void isr_timer2(void)
+// Advances the turn signal blink phase on every tick, the phase is committed
+// to LATA at the start of the next tick
+void blink_tick(void)
 {
-    static int16 ms = 0;
-    if (ms >= BLINK_PERIOD_MS)
+    static int16 blink_ms = 0;
+    
+    if (gb_blink_restart == true)
     {
-        ms = 0;
-        gb_blink = true;
-        
-        // Blink heartbeat LED
-        output_toggle(LED_PIN);
+        // Restart the blink period with an on phase now, the edge before it
+        // doesn't end a regular period
+        gb_blink_restart = false;
+        gb_blink_phase = false;
+        blink_ms = BLINK_PERIOD_MS;
+        gb_blink_period_valid = false;
     }
-    else
+    
+    blink_ms++;
+    if (blink_ms < BLINK_PERIOD_MS)
     {
-        ms++;
+        return;
     }
+    blink_ms = 0;
+    
+    gb_blink_phase = !gb_blink_phase;
+    gb_blink_edge = true;
 }
 
-// CAN receive buffer 0 interrupt
-#int_canrx0
-void isr_canrx0()
+// Called once a blink edge has been written to LATA
+void blink_edge_done(void)
 {
-    int32 rx_id;
-    int8  rx_len;
-    int8  rx_data[8];
-    struct rx_stat rxstat;
+    static int32 last_edge;
+    int32 now;
     
-    if (can_getd(rx_id, rx_data, rx_len, rxstat))
+    gb_blink_edge = false;
+    
+    // Blink heartbeat LED
+    output_toggle(LED_PIN);
+    
+    // Measure the edge to edge period, restarted periods don't count. Only
+    // the subtraction is done here, jitter_task does the rest of the sums.
+    now = timebase_now_isr();
+    if ((gb_blink_period_valid == true) && (gb_blink_period_ready == false))
     {
-        // A CAN command was received, set the appropriate flag
-        switch(rx_id)
+        g_blink_edge_period = now - last_edge;
+        gb_blink_period_ready = true;
+    }
+    last_edge = now;
+    gb_blink_period_valid = true;
+}
+
+// Advances the strobe phase on every tick while the strobe is running
+void strobe_tick(void)
+{
+    static int8 strobe_ms = 0;
+    
+    if (gb_strobe == true)
+    {
+        strobe_ms++;
+        if (strobe_ms >= STROBE_PERIOD_MS)
         {
-            case COMMAND_LEFT_SIGNAL_ID:
-                gb_left_sig = !gb_left_sig;
-                gb_right_sig = false;
-                break;
-            case COMMAND_RIGHT_SIGNAL_ID:
-                gb_right_sig = !gb_right_sig;
-                gb_left_sig = false;
-                break;
-            case COMMAND_HAZARD_SIGNAL_ID:
-                gb_hazard_sig = !gb_hazard_sig;
-                // If the hazard signal is turned on, reset the turn signals
-                output_low(LEFT_OUT_PIN);
-                output_low(RIGHT_OUT_PIN);
-                break;
-            case COMMAND_BPS_TRIP_SIGNAL_ID:
-                gb_bps_trip = true;
-                write_eeprom(EEPROM_ADDRESS,BPS_TRIP_FLAG);
-                break;
-            case COMMAND_PMS_BRAKE_LIGHT_ID:
-                gb_mech_sig = !gb_mech_sig;
-                break;
-            default:
-                break;
+            strobe_ms = 0;
+            gb_strobe_phase = !gb_strobe_phase;
         }
     }
 }
 
-// CAN receive buffer 1 interrupt
-#int_canrx1
-void isr_canrx1()
+// Works out the lamp bits for the next tick from the phases just advanced
+void lamp_prepare(void)
+{
+    int8 lamps;
+    
+    lamps = g_lamp_steady;
+    if (gb_blink_phase == true)
+    {
+        lamps |= g_blink_word;
+    }
+    if (gb_strobe_phase == true)
+    {
+        lamps |= LAMP_BIT(STROBE_OUT_PIN);
+    }
+    
+    g_lamp_next = lamps;
+}
+
+// Writes every lamp to LATA at once. This is the only write to the lamp pins
+// after startup, so there is no read-modify-write of PORTA that the main
+// loop and the interrupts could interleave.
+void lamp_commit(void)
+{
+    LATA = (LATA & ~LAMP_MASK) | g_lamp_next;
+}
+
+#int_timer2
+void isr_timer2(void)
+{
+    // The word worked out on the previous tick goes out first, so the edges
+    // land a fixed time after the timer match. Timing and statistics come
+    // after the write.
+    lamp_commit();
+    if (gb_blink_edge == true)
+    {
+        blink_edge_done();
+    }
+    
+    debounce_tick();
+    sched_tick();
+    
+    // Work out the lamp word for the next tick
+    blink_tick();
+    strobe_tick();
+    lamp_prepare();
+}
+
+// Returns all the signal flags as they were at one instant
+int8 signals_snapshot(void)
+{
+    return g_signals; // A single byte read can't be torn
+}
+
+// Clears then sets several signal flags with a single store, so a reader
+// never sees the flags half way through the change
+void signals_update(int8 clear, int8 set)
+{
+    g_signals = (g_signals & ~clear) | set;
+}
+
+// CAN command handlers, called from the main loop by can_rx_process
+// One handler per entry of CAN_MISC_TABLE
+typedef void (*can_cmd_handler_t)(int8 *data, int8 len);
+
+void can_cmd_left_signal(int8 *data, int8 len)
+{
+    // Toggle the left flag and clear the right flag
+    signals_update(SIGNAL_LEFT | SIGNAL_RIGHT, ~signals_snapshot() & SIGNAL_LEFT);
+}
+
+void can_cmd_right_signal(int8 *data, int8 len)
+{
+    // Toggle the right flag and clear the left flag
+    signals_update(SIGNAL_LEFT | SIGNAL_RIGHT, ~signals_snapshot() & SIGNAL_RIGHT);
+}
+
+void can_cmd_hazard_signal(int8 *data, int8 len)
+{
+    gb_hazard_sig = !gb_hazard_sig;
+}
+
+void can_cmd_bps_trip(int8 *data, int8 len)
+{
+    gb_bps_trip = true;
+    eeprom_write_async(EEPROM_ADDRESS,BPS_TRIP_FLAG);
+}
+
+void can_cmd_brake_light(int8 *data, int8 len)
+{
+    gb_mech_sig = !gb_mech_sig;
+}
+
+void can_cmd_idle_park(int8 *data, int8 len)
+{
+    gb_idle_park_request = true;
+}
+
+// Handler table, indexed by (id - CAN_MISC_BASE_ID)
+// Filter n only accepts entry n of CAN_MISC_TABLE (see can_init), so the
+// table is also indexed by the filter hit
+const can_cmd_handler_t g_can_cmd_handlers[N_CAN_COMMAND] =
+{
+    CAN_MISC_TABLE(EXPAND_AS_MISC_HANDLER_ARRAY)
+};
+
+// Handles every CAN command queued by the receive interrupt
+void can_rx_process(void)
+{
+    can_frame_t frame;
+    
+    while (can_rx_queue_pop(&frame))
+    {
+        (*g_can_cmd_handlers[frame.cmd])(frame.data, frame.len);
+    }
+}
+
+// Empties the receive FIFO, queueing every command for the main loop
+void can_rx_drain(void)
 {
-    int32 rx_id;
+#if !CAN_RX_DISPATCH_FILTHIT
+    int16 rx_sid;
+#endif
     int8  rx_len;
     int8  rx_data[8];
+    int8  cmd;
+    int8  window;
     struct rx_stat rxstat;
+#if CAN_RX_PROFILE
+    int16 start;
+    
+    start = get_timer1();
+#endif
+    
+    // The main loop may have a transmit buffer mapped in can_putd
+    window = ECANCON.ewin;
     
-    if (can_getd(rx_id, rx_data, rx_len, rxstat))
+#if CAN_RX_DISPATCH_FILTHIT
+    while (can_fifo_getd_hit(rx_data, rx_len, rxstat))
+#else
+    while (can_fifo_getd_sid(rx_sid, rx_data, rx_len, rxstat))
+#endif
     {
-        // A CAN command was received, set the appropriate flag
-        switch(rx_id)
+        if (rxstat.err_ovfl)
+        {
+            // Frames were lost since the last read
+            g_can_rx_overflows++;
+        }
+        
+#if CAN_RX_DISPATCH_FILTHIT
+        // Filter n only accepts entry n of CAN_MISC_TABLE
+        cmd = rxstat.filthit;
+#else
+        // Match the SIDH:SIDL register bytes against the constant IDs
+        // instead of building the 32 bit ID
+        cmd = N_CAN_COMMAND;
+        if ((rx_sid >= CAN_STD_SID16(CAN_MISC_BASE_ID)) &&
+            (rx_sid <  CAN_STD_SID16(CAN_MISC_BASE_ID + N_CAN_COMMAND)))
+        {
+            cmd = (int8)((rx_sid - CAN_STD_SID16(CAN_MISC_BASE_ID)) >> 5);
+        }
+#endif
+        gb_can_rx_activity = true;
+        if (cmd < N_CAN_COMMAND)
+        {
+            can_rx_queue_push(cmd, rx_data, rx_len);
+        }
+        
+#if CAN_RX_PROFILE
+        // Timer 1 counts instruction cycles
+        g_can_rx_cycles = get_timer1() - start;
+        if (g_can_rx_cycles > g_can_rx_cycles_max)
         {
-            case COMMAND_LEFT_SIGNAL_ID:
-                gb_left_sig = !gb_left_sig;
-                gb_right_sig = false;
-                break;
-            case COMMAND_RIGHT_SIGNAL_ID:
-                gb_right_sig = !gb_right_sig;
-                gb_left_sig = false;
-                break;
-            case COMMAND_HAZARD_SIGNAL_ID:
-                gb_hazard_sig = !gb_hazard_sig;
-                // If the hazard signal is turned on, reset the turn signals
-                output_low(LEFT_OUT_PIN);
-                output_low(RIGHT_OUT_PIN);
-                break;
-            case COMMAND_BPS_TRIP_SIGNAL_ID:
-                gb_bps_trip = true;
-                write_eeprom(EEPROM_ADDRESS,BPS_TRIP_FLAG);
-                break;
-            case COMMAND_PMS_BRAKE_LIGHT_ID:
-                gb_mech_sig = !gb_mech_sig;
-                break;
-            default:
-                break;
+            g_can_rx_cycles_max = g_can_rx_cycles;
         }
+        start = get_timer1();
+#endif
     }
+    
+    ECANCON.ewin = window;
 }
 
-void idle_state(void)
+// CAN FIFO high water mark interrupt
+#int_canrx0
+void isr_canrx0()
 {
-    // Check the strobe signal
-    if (gb_bps_trip == true)
+    can_rx_drain();
+}
+
+// CAN receive interrupt
+// The flag is cleared by can_fifo_getd, so a frame arriving while the FIFO is
+// being drained will re-trigger the interrupt
+#int_canrx1 NOCLEAR
+void isr_canrx1()
+{
+    can_rx_drain();
+}
+
+void bps_trip_state(void)
+{
+    // Turn off all lights from the next tick
+    g_lamp_steady = 0;
+    g_blink_word  = 0;
+    
+    // Start pulsing the strobe light, the timer interrupt keeps it going
+    gb_strobe = true;
+}
+
+// Enters the trip state as soon as the BPS trips
+void bps_task(void)
+{
+    static int16 ms = 0;
+    static int1  b_erased = false;
+    
+    if (gb_bps_trip == false)
     {
-        // The BPS has tripped, go immediately to the trip state
-        g_state = BPS_TRIP;
         return;
     }
     
-    // Turn on the brake lights if either brake switch is on
-    // Ternary statement
-    // (Condition)                ? (Action if true)           : (Action if false)
-    (gb_regen_sig || gb_mech_sig) ? output_high(BRAKE_OUT_PIN) : output_low(BRAKE_OUT_PIN);
+    if (gb_strobe == false)
+    {
+        // The BPS has tripped, go immediately to the trip state
+        bps_trip_state();
+    }
+    
+    // Sometimes the blinker will reset itself when the bps trips. This is
+    // due to the relay not switching fast enough between 12V and AUX,
+    // causing the circuit to turn off and back on.
+    
+    // Once the strobe light has been blinking for a certain amount of time
+    // (eg. 2 seconds), it can be assumed that a reset did not occur, and
+    // the eeprom can be erased.
+    
+    // This will prevent the blinker from flashing the strobe lights if it
+    // is turned on after a trip event that did not cause the blinker to reset.
     
-    if (gb_blink == true)
+    if (b_erased == false)
     {
-        // Time to blink
-        g_state = BLINK;
+        if (ms >= POWER_RESET_TIMEOUT_MS)
+        {
+            eeprom_write_async(EEPROM_ADDRESS,BPS_SUCCESS_FLAG); // Erase the eeprom
+            b_erased = true; // Only erase the eeprom once
+        }
+        else
+        {
+            ms++;
+        }
     }
-    else
+    
+    // The BPS has tripped, the blinker will stay in this state and will not
+    // exit until the car is restarted
+}
+
+// Works out every lamp from the truth table, the timer interrupt commits them
+// with the turn signals blinking on the blink edges
+void lamp_task(void)
+{
+    int8 lamps;
+    
+    lamps = lamp_logic(signals_snapshot());
+    
+    g_blink_word  = lamps & TURN_MASK;
+    g_lamp_steady = lamps & ~TURN_MASK;
+}
+
+// When a turn signal or the hazards turn on, the blink period restarts so the
+// first flash happens on the next tick instead of up to BLINK_PERIOD_MS later
+void turn_signal_task(void)
+{
+    static int8 last = 0;
+    int8 signals;
+    int8 started;
+    
+    signals = signals_snapshot();
+    started = signals & ~last & (SIGNAL_LEFT | SIGNAL_RIGHT | SIGNAL_HAZARD);
+    last = signals;
+    
+    if ((started != 0) && !bit_test(signals, LAMP_IN_BPS_TRIP))
     {
-        // Check the switches if not blinking
-        g_state = CHECK_SWITCHES;
+        gb_blink_restart = true;
     }
 }
 
-void blink_state(void)
+// Integer square root
+int16 isqrt(int32 x)
 {
-    gb_blink = false;
+    int32 root;
+    int32 bit;
     
-    if (gb_hazard_sig == true)
+    root = 0;
+    bit  = 0x40000000;
+    while (bit > x)
     {
-        // Hazard lights are active, blink both turn signals
-        output_toggle(LEFT_OUT_PIN);
-        output_toggle(RIGHT_OUT_PIN);
+        bit >>= 2;
     }
-    else
+    while (bit != 0)
     {
-        // Hazard lights are not active, blink turn signals if needed
-        
-        // Ternary statements
-        // (Condition)         ? (Action if true)             : (Action if false)
-        (gb_left_sig == true)  ? output_toggle(LEFT_OUT_PIN)  : output_low(LEFT_OUT_PIN);
-        (gb_right_sig == true) ? output_toggle(RIGHT_OUT_PIN) : output_low(RIGHT_OUT_PIN);
+        if (x >= root + bit)
+        {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
     }
-    
-    // Return to the idle state
-    g_state = IDLE;
+    return (int16)root;
 }
 
-void check_switches_state(void)
+// Gathers the blink edge periods measured by the timer interrupt and works out
+// their min/max/stddev over every BLINK_JITTER_EDGES edges. The squaring is
+// done here, a 32 bit multiply in the interrupt would share the compiler's
+// multiply helper with the main loop.
+void jitter_task(void)
 {
-    static int1 b_regen_switch  = false;
-    static int1 b_mech_switch   = false;
-    static int1 b_left_switch   = false;
-    static int1 b_right_switch  = false;
-    static int1 b_hazard_switch = false;
+    static int32 period_min;
+    static int32 period_max;
+    static signed int32 sum;
+    static int32 sumsq;
+    static int8  n = 0;
+    int32 period;
+    signed int32 error;
+    signed int32 mean;
+    int32 variance;
     
-    // Check the regen brake switch
-    if ((input_state(REGEN_IN_PIN) == 1) && (b_regen_switch == false))
+    if (gb_blink_period_ready == false)
     {
-        DEBOUNCE;
-        if (input_state(REGEN_IN_PIN) == 1)
-        {
-            b_regen_switch = true;
-            gb_regen_sig = true;
-        }
+        return;
     }
-    else if ((input_state(REGEN_IN_PIN) == 0) && (b_regen_switch == true))
+    period = g_blink_edge_period;
+    gb_blink_period_ready = false;
+    
+    if ((n == 0) || (period < period_min))
     {
-        DEBOUNCE;
-        if (input_state(REGEN_IN_PIN) == 0)
-        {
-            b_regen_switch = false;
-            gb_regen_sig = false;
-        }
+        period_min = period;
+    }
+    if ((n == 0) || (period > period_max))
+    {
+        period_max = period;
+    }
+    error = (signed int32)(period - BLINK_PERIOD_CYCLES);
+    if (n == 0)
+    {
+        sum   = 0;
+        sumsq = 0;
     }
+    sum   += error;
+    sumsq += error * error;
+    n++;
     
-    // Check the mechanical brake switch
-    if ((input_state(MECH_IN_PIN) == 1) && (b_mech_switch == false))
+    if (n < BLINK_JITTER_EDGES)
     {
-        DEBOUNCE;
-        if (input_state(MECH_IN_PIN) == 1)
-        {
-            b_mech_switch = true;
-            gb_mech_sig   = true;
-        }
+        return;
     }
-    else if ((input_state(MECH_IN_PIN) == 0) && (b_mech_switch == true))
+    n = 0;
+    
+    g_blink_period_min = period_min;
+    g_blink_period_max = period_max;
+    mean = sum / BLINK_JITTER_EDGES;
+    variance = sumsq / BLINK_JITTER_EDGES - (int32)(mean * mean);
+    g_blink_period_stddev = isqrt(variance);
+}
+
+// Idle park: the CPU core and the 1ms tick stop until a CAN frame or a switch
+// wakes the blinker. This is not a deep sleep: the oscillator keeps running
+// and the ECAN stays in normal mode, so the frame that wakes the blinker is
+// received and handled like any other.
+void idle_park(void)
+{
+    // The lights are already off, turn off the heartbeat LED too
+    output_low(LED_PIN);
+    disable_interrupts(INT_TIMER2);
+    
+    // Timer 1 overflows would wake the core every 13ms. The timebase misses
+    // the parked time, at most one overflow is counted when it is unmasked.
+    disable_interrupts(INT_TIMER1);
+    
+    gb_can_rx_activity = false;
+    g_idle_park_count++;
+    
+    // With interrupts masked a wake-up can't slip in between the check and
+    // the sleep. A pending interrupt still wakes the CPU, and its handler runs
+    // once interrupts are enabled again.
+    disable_interrupts(GLOBAL);
+    while ((gb_can_rx_activity == false) && (debounce_busy() == false))
     {
-        DEBOUNCE;
-        if (input_state(MECH_IN_PIN) == 0)
-        {
-            b_mech_switch = false;
-            gb_mech_sig   = false;
-        }
+        sleep();
+        delay_cycles(1);
+        enable_interrupts(GLOBAL);
+        disable_interrupts(GLOBAL);
     }
+    enable_interrupts(GLOBAL);
     
-    // CAN BUS CONTROLLED LIGHTS
-    // The following switches are also controlled by CAN bus,
-    // need seperate flags to store the state of the hardware switch
+    // The next blink edge is measured from the last one before the park, and
+    // the timebase missed the parked time anyway. Drop it.
+    gb_blink_period_valid = false;
     
-    // Check the left turn signal
-    if ((input_state(LEFT_IN_PIN) == 1) && (b_left_switch == false))
+    enable_interrupts(INT_TIMER1);
+    clear_interrupt(INT_TIMER2);
+    enable_interrupts(INT_TIMER2);
+}
+
+// Idle parks the blinker when the car asks for it with COMMAND_IDLE_PARK and
+// nothing is going on. A request that arrives while anything is active is
+// dropped, the car has to ask again once it really is parked.
+void idle_park_task(void)
+{
+    if (gb_idle_park_request == false)
     {
-        DEBOUNCE;
-        if (input_state(LEFT_IN_PIN) == 1)
-        {
-            b_left_switch = true;
-            gb_left_sig   = true;
-            gb_right_sig  = false; // Clear the right flag
-        }
+        return;
     }
-    else if ((input_state(LEFT_IN_PIN) == 0) && (b_left_switch == true))
+    gb_idle_park_request = false;
+    
+    if ((signals_snapshot() != 0) || !can_rx_queue_empty() ||
+        (can_tx_queue_depth() != 0) || debounce_busy() || eeprom_busy())
     {
-        DEBOUNCE;
-        if (input_state(LEFT_IN_PIN) == 0)
-        {
-            b_left_switch = false;
-            gb_left_sig   = false;
-        }
+        return;
     }
     
-    // Check the right turn signal
-    if ((input_state(RIGHT_IN_PIN) == 1) && (b_right_switch == false))
+    idle_park();
+}
+
+// Copies the counters the CAN receive interrupt increments. They are 16 bits,
+// so reading them a byte at a time could straddle an increment.
+void can_rx_counters_snapshot(int16 *overflows, int16 *queue_drops)
+{
+    disable_interrupts(GLOBAL);
+    *overflows   = g_can_rx_overflows;
+    *queue_drops = g_can_rx_queue_drops;
+    enable_interrupts(GLOBAL);
+}
+
+// Packs the light status frame, see TELEM_BLINKER_STATUS_ID in can_telem.h
+void status_pack(int8 *data)
+{
+    int16 overflows;
+    int16 queue_drops;
+    int8 flags;
+    
+    flags = 0;
+    if (gb_blink_phase == true)
     {
-        DEBOUNCE;
-        if (input_state(RIGHT_IN_PIN) == 1)
-        {
-            b_right_switch = true;
-            gb_right_sig   = true;
-            gb_left_sig    = false; // Clear the left flag
-        }
+        flags |= STATUS_FLAG_BLINK_PHASE;
     }
-    else if ((input_state(RIGHT_IN_PIN) == 0) && (b_right_switch == true))
+    if (gb_strobe == true)
     {
-        DEBOUNCE;
-        if (input_state(RIGHT_IN_PIN) == 0)
-        {
-            b_right_switch = false;
-            gb_right_sig   = false;
-        }
+        flags |= STATUS_FLAG_STROBE;
+    }
+    if (gb_strobe_phase == true)
+    {
+        flags |= STATUS_FLAG_STROBE_PHASE;
+    }
+    if (gb_bps_trip == true)
+    {
+        flags |= STATUS_FLAG_BPS_TRIP;
     }
     
-    // Check the hazard switch
-    if ((input_state(HAZARD_IN_PIN) == 1) && (b_hazard_switch == false))
+    can_rx_counters_snapshot(&overflows, &queue_drops);
+    
+    data[0] = LATA & LAMP_MASK;
+    data[1] = debounce_state() & SWITCH_MASK;
+    data[2] = signals_snapshot();
+    data[3] = flags;
+    data[4] = g_status_seq;
+    data[5] = (queue_drops > 0xFF) ? 0xFF : make8(queue_drops, 0);
+    data[6] = make8(overflows, 1);
+    data[7] = make8(overflows, 0);
+}
+
+// Sends the light status frame when the state changes, at most once every
+// STATUS_MIN_GAP_MS, and every STATUS_KEEPALIVE_MS while nothing changes.
+// Changes within the gap are coalesced into one frame with the latest state,
+// and an input that flaps back before the gap ends sends nothing. The blink
+// and strobe phases toggle on their own so they don't count as changes, the
+// commanded lamps do.
+void status_task(void)
+{
+    static int8 sent_lamps    = 0;
+    static int8 sent_switches = 0;
+    static int8 sent_signals  = 0;
+    static int1 sb_sent_strobe = false;
+    int8 lamps;
+    int8 switches;
+    int8 signals;
+    int1 b_changed;
+    int8 data[TELEM_BLINKER_STATUS_LEN];
+    
+    if (g_status_gap_ms < STATUS_KEEPALIVE_MS)
     {
-        DEBOUNCE;
-        if (input_state(HAZARD_IN_PIN) == 1)
-        {
-            b_hazard_switch = true;
-            gb_hazard_sig   = true;
-        }
+        g_status_gap_ms++;
     }
-    else if ((input_state(HAZARD_IN_PIN) == 0) && (b_hazard_switch == true))
+    
+    lamps    = g_blink_word | g_lamp_steady;
+    switches = debounce_state() & SWITCH_MASK;
+    signals  = signals_snapshot();
+    
+    b_changed = (lamps != sent_lamps) || (switches != sent_switches) ||
+                (signals != sent_signals) || (gb_strobe != sb_sent_strobe);
+    
+    if (!(b_changed && (g_status_gap_ms >= STATUS_MIN_GAP_MS)) &&
+        (g_status_gap_ms < STATUS_KEEPALIVE_MS))
     {
-        DEBOUNCE;
-        if (input_state(HAZARD_IN_PIN) == 0)
-        {
-            b_hazard_switch = false;
-            gb_hazard_sig   = false;
-        }
+        return;
+    }
+    
+    status_pack(data);
+    if (can_tx_queue_push(TELEM_BLINKER_STATUS_ID, data, TELEM_BLINKER_STATUS_LEN, STATUS_PRIORITY) == false)
+    {
+        // The transmit queue is full, try again on the next tick
+        g_status_tx_fails++;
+        return;
     }
+    g_status_seq++;
+    g_status_gap_ms = 0;
     
-    // Return to idle
-    g_state = IDLE;
+    if (b_changed == true)
+    {
+        g_status_event_frames++;
+    }
+    else
+    {
+        g_status_keepalive_frames++;
+    }
+    
+    sent_lamps     = lamps;
+    sent_switches  = switches;
+    sent_signals   = signals;
+    sb_sent_strobe = gb_strobe;
 }
 
-void bps_trip_state(void)
+// Packs the diagnostic counters reply, see CAN_RTR_TABLE in can_telem.h
+void counters_pack(int8 *data)
 {
-    int16 counter = 0;
-    int1  b_erased = false;
+    int16 overflows;
+    int16 queue_drops;
     
-    // Turn off all lights
-    output_low(LEFT_OUT_PIN);
-    output_low(RIGHT_OUT_PIN);
-    output_low(BRAKE_OUT_PIN);
+    can_rx_counters_snapshot(&overflows, &queue_drops);
+    data[0] = make8(overflows, 1);
+    data[1] = make8(overflows, 0);
+    data[2] = make8(queue_drops, 1);
+    data[3] = make8(queue_drops, 0);
+    data[4] = make8(g_can_tx_queue_drops, 1);
+    data[5] = make8(g_can_tx_queue_drops, 0);
+    data[6] = make8(g_status_tx_fails, 1);
+    data[7] = make8(g_status_tx_fails, 0);
+}
+
+// Packs the firmware identity reply
+void firmware_pack(int8 *data)
+{
+    data[0] = 'B';
+    data[1] = 'L';
+    data[2] = 'N';
+    data[3] = 'K';
+    data[4] = FIRMWARE_VERSION_MAJOR;
+    data[5] = FIRMWARE_VERSION_MINOR;
+    data[6] = FIRMWARE_VERSION_PATCH;
+    data[7] = TELEM_LAYOUT_VERSION;
+}
+
+// Keeps the remote frame replies up to date, the ECAN answers them by itself
+// Buffers are only rewritten when their data changes, a reply that is going
+// out is refreshed on the next run instead
+void rtr_task(void)
+{
+    int8 data[8];
     
-    // Pulse the strobe light
-    while(true)
+    status_pack(data);
+    can_rtr_refresh(TELEM_RTR_STATUS_INDEX, data, TELEM_BLINKER_STATUS_LEN);
+    
+    counters_pack(data);
+    can_rtr_refresh(TELEM_RTR_COUNTERS_INDEX, data, 8);
+    
+    // Only loaded once, the comparison is all that runs afterwards
+    firmware_pack(data);
+    can_rtr_refresh(TELEM_RTR_FIRMWARE_INDEX, data, 8);
+}
+
+void switch_task(void)
+{
+    int8 state;
+    int8 changed;
+    
+    // The switches are debounced by the timer tick, only act on the edges
+    state = debounce_read(&changed);
+    
+    // Check the regen brake switch
+    if (bit_test(changed, SWITCH_REGEN))
     {
-        output_toggle(STROBE_OUT_PIN);
-        delay_ms(STROBE_PERIOD_MS);
-        
-        // Sometimes the blinker will reset itself when the bps trips. This is
-        // due to the relay not switching fast enough between 12V and AUX,
-        // causing the circuit to turn off and back on.
-        
-        // Once the strobe light has been blinking for a certain amount of time
-        // (eg. 2 seconds), it can be assumed that a reset did not occur, and
-        // the eeprom can be erased.
-        
-        // This will prevent the blinker from flashing the strobe lights if it
-        // is turned on after a trip event that did not cause the blinker to reset.
-        
-        if (b_erased == false)
+        gb_regen_sig = bit_test(state, SWITCH_REGEN);
+    }
+    
+    // Check the mechanical brake switch
+    if (bit_test(changed, SWITCH_MECH))
+    {
+        gb_mech_sig = bit_test(state, SWITCH_MECH);
+    }
+    
+    // CAN BUS CONTROLLED LIGHTS
+    // The following switches are also controlled by CAN bus, so only the
+    // edges of the hardware switch change the flags
+    
+    // Check the left turn signal
+    if (bit_test(changed, SWITCH_LEFT))
+    {
+        if (bit_test(state, SWITCH_LEFT))
         {
-            if ((counter >= POWER_RESET_TIMEOUT_MS/STROBE_PERIOD_MS))
-            {
-                write_eeprom(EEPROM_ADDRESS,BPS_SUCCESS_FLAG); // Erase the eeprom
-                b_erased = true; // Only erase the eeprom once
-            }
-            else
-            {
-                counter++;
-            }
+            signals_update(SIGNAL_RIGHT, SIGNAL_LEFT); // Clear the right flag
+        }
+        else
+        {
+            gb_left_sig = false;
         }
     }
     
-    // The BPS has tripped, the blinker will fall into this state and will not
-    // exit until the car is restarted
+    // Check the right turn signal
+    if (bit_test(changed, SWITCH_RIGHT))
+    {
+        if (bit_test(state, SWITCH_RIGHT))
+        {
+            signals_update(SIGNAL_LEFT, SIGNAL_RIGHT); // Clear the left flag
+        }
+        else
+        {
+            gb_right_sig = false;
+        }
+    }
+    
+    // Check the hazard switch
+    if (bit_test(changed, SWITCH_HAZARD))
+    {
+        gb_hazard_sig = bit_test(state, SWITCH_HAZARD);
+    }
 }
 
 void main()
 {
+#if MAIN_LOOP_PROFILE
+    int16 loop_start;
+    int16 loop_cycles;
+#endif
+    
     // Reset the eeprom memory
     write_eeprom(EEPROM_ADDRESS,BPS_SUCCESS_FLAG);
     
@@ -371,43 +868,54 @@ void main()
     enable_interrupts(INT_CANRX1);
     
     // Enable timer interrupts
-    setup_timer_2(T2_DIV_BY_4,79,16); // Timer 2 set up to interrupt every 1ms with a 20MHz clock
+    timebase_init(); // Timer 1 free runs at the instruction clock (Fosc/4)
+    setup_timer_2(T2_DIV_BY_4,79,16); // Timer 2 set up to interrupt every 1ms with a 20MHz clock (SCHED_TICK_CYCLES)
     enable_interrupts(INT_TIMER2);
     enable_interrupts(GLOBAL);
     
     blinker_init();
     can_init();
+    can_tx_queue_init(); // Needs the ECAN in mode 2
+    can_rtr_init();
     
     // On startup, check if the blinker was reset due to a bps trip
     if (read_eeprom(EEPROM_ADDRESS) == BPS_TRIP_FLAG)
     {
-        // If the bps was tripped, start in the bps trip state
-        g_state = BPS_TRIP;
-    }
-    else
-    {
-        // The bps did not trip, this is a normal restart, start in idle as usual
-        g_state = IDLE;
+        // If the bps was tripped, go straight to the bps trip state
+        gb_bps_trip = true;
     }
     
+    // Register the tasks, all times are in 1ms ticks
+    //        Task             , Period             , Phase , Priority
+    sched_add(can_rx_process   , 1                  , 0     , 0);
+    sched_add(switch_task      , 1                  , 0     , 1);
+    sched_add(bps_task         , 1                  , 0     , 2);
+    sched_add(turn_signal_task , 1                  , 0     , 3);
+    sched_add(lamp_task        , 1                  , 0     , 4);
+    sched_add(eeprom_service   , 1                  , 0     , 5);
+    sched_add(idle_park_task   , IDLE_PARK_CHECK_MS , 0     , 6);
+    sched_add(jitter_task      , JITTER_CHECK_MS    , 0     , 7);
+    sched_add(status_task      , 1                  , 0     , 8);
+    sched_add(rtr_task         , RTR_REFRESH_MS     , 0     , 9);
+    
     while(true)
     {
-        switch(g_state)
+#if MAIN_LOOP_PROFILE
+        loop_start = get_timer1();
+#endif
+        
+        sched_run();
+        
+#if MAIN_LOOP_PROFILE
+        // Timer 1 counts instruction cycles
+        loop_cycles = get_timer1() - loop_start;
+        if (loop_cycles > g_loop_cycles_max)
         {
-            case IDLE:
-                idle_state();
-                break;
-            case BLINK:
-                blink_state();
-                break;
-            case CHECK_SWITCHES:
-                check_switches_state();
-                break;
-            case BPS_TRIP:
-                bps_trip_state();
-                break;
-            default:
-                break;
+            g_loop_cycles_max = loop_cycles;
         }
+#endif
+        
+        // Nothing to do until the next interrupt
+        sched_idle();
     }
 }
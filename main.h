@@ -30,15 +30,21 @@
 #define REGEN_IN_PIN   PIN_B4
 #define MECH_IN_PIN    PIN_B5
 
+#define EXPAND_AS_SWITCH_ENUM(a,b) a = ((b) & 7),
+#define EXPAND_AS_SWITCH_MASK(a,b) | (1 << ((b) & 7))
+
+// X macro table of debounced switches, all switches must be on PORTB
+//        Switch name   , Pin
+#define SWITCH_TABLE(ENTRY)            \
+    ENTRY(SWITCH_LEFT   , LEFT_IN_PIN)   \
+    ENTRY(SWITCH_RIGHT  , RIGHT_IN_PIN)  \
+    ENTRY(SWITCH_HAZARD , HAZARD_IN_PIN) \
+    ENTRY(SWITCH_REGEN  , REGEN_IN_PIN)  \
+    ENTRY(SWITCH_MECH   , MECH_IN_PIN)
+
+// Bit n of the debounced switch state is PORTB bit n
+enum {SWITCH_TABLE(EXPAND_AS_SWITCH_ENUM)};
+#define SWITCH_MASK (0 SWITCH_TABLE(EXPAND_AS_SWITCH_MASK))
+
 // HEARTBEAT LED
 #define LED_PIN        PIN_C0
-
-// State machine states
-typedef enum
-{
-    IDLE,
-    BLINK,
-    CHECK_SWITCHES,
-    BPS_TRIP,
-    N_STATES
-} blinker_state_t;
@@ -0,0 +1,160 @@
+#include "scheduler.h"
+
+// Registered tasks, kept sorted by priority
+static sched_task_t g_sched_tasks[SCHED_MAX_TASKS];
+static int8         g_sched_n_tasks;
+
+static int8  g_sched_ticks;         // Incremented by the timer interrupt
+static int8  g_sched_ticks_seen;    // Ticks already handled by sched_run
+static int16 g_sched_tick_overruns; // Ticks that passed without a sched_run
+
+// Time spent asleep
+static int32 g_sched_sleep_cycles;  // Cycles asleep in the current window
+static int16 g_sched_window_ticks;  // Ticks handled in the current window
+static int16 g_sched_sleep_permille; // Fraction of the last window spent asleep
+
+void sched_init(void)
+{
+    g_sched_n_tasks       = 0;
+    g_sched_ticks         = 0;
+    g_sched_ticks_seen    = 0;
+    g_sched_tick_overruns = 0;
+    
+    g_sched_sleep_cycles   = 0;
+    g_sched_window_ticks   = 0;
+    g_sched_sleep_permille = 0;
+    
+    // Sleep enters IDLE mode, leaving the peripheral clocks running
+    OSCCON_IDLEN = 1;
+}
+
+// Registers a task, first released phase ticks from now and every period
+// ticks after that. Tasks of equal priority run in registration order.
+// Returns false if the task table is full
+int1 sched_add(sched_fn_t fn, int16 period, int16 phase, int8 priority)
+{
+    int8 i;
+    
+    if (g_sched_n_tasks >= SCHED_MAX_TASKS)
+    {
+        return false;
+    }
+    
+    // Insert behind every task of the same or higher priority
+    i = g_sched_n_tasks;
+    while ((i > 0) && (g_sched_tasks[i - 1].priority > priority))
+    {
+        g_sched_tasks[i] = g_sched_tasks[i - 1];
+        i--;
+    }
+    
+    g_sched_tasks[i].fn         = fn;
+    g_sched_tasks[i].period     = period;
+    g_sched_tasks[i].countdown  = phase + 1;
+    g_sched_tasks[i].priority   = priority;
+    g_sched_tasks[i].pending    = false;
+    g_sched_tasks[i].cycles     = 0;
+    g_sched_tasks[i].cycles_max = 0;
+    g_sched_tasks[i].overruns   = 0;
+    g_sched_n_tasks++;
+    return true;
+}
+
+// Counts a tick, called from the timer interrupt
+void sched_tick(void)
+{
+    g_sched_ticks++;
+}
+
+// Releases the tasks due on one tick
+void sched_release(void)
+{
+    sched_task_t *task;
+    int8 i;
+    
+    for (i = 0 ; i < g_sched_n_tasks ; i++)
+    {
+        task = &g_sched_tasks[i];
+        task->countdown--;
+        if (task->countdown == 0)
+        {
+            task->countdown = task->period;
+            if (task->pending == true)
+            {
+                // The previous release never got to run
+                task->overruns++;
+            }
+            task->pending = true;
+        }
+    }
+}
+
+// Runs every task released since the last call, called from the main loop
+void sched_run(void)
+{
+    sched_task_t *task;
+    int8  ticks;
+    int8  i;
+    int16 start;
+    
+    // Single byte read, the interrupt can't tear it
+    ticks = g_sched_ticks - g_sched_ticks_seen;
+    if (ticks == 0)
+    {
+        return;
+    }
+    g_sched_ticks_seen += ticks;
+    g_sched_tick_overruns += ticks - 1;
+    
+    for ( ; ticks > 0 ; ticks--)
+    {
+        sched_release();
+        
+        g_sched_window_ticks++;
+        if (g_sched_window_ticks >= SCHED_LOAD_WINDOW)
+        {
+            g_sched_sleep_permille = g_sched_sleep_cycles / ((int32)SCHED_TICK_CYCLES * SCHED_LOAD_WINDOW / 1000);
+            g_sched_sleep_cycles = 0;
+            g_sched_window_ticks = 0;
+        }
+    }
+    
+    // The table is sorted, so this runs the highest priority first
+    for (i = 0 ; i < g_sched_n_tasks ; i++)
+    {
+        task = &g_sched_tasks[i];
+        if (task->pending == true)
+        {
+            task->pending = false;
+            
+            // Timer 1 counts instruction cycles
+            start = get_timer1();
+            (*task->fn)();
+            task->cycles = get_timer1() - start;
+            if (task->cycles > task->cycles_max)
+            {
+                task->cycles_max = task->cycles;
+            }
+        }
+    }
+}
+
+// Sleeps until the next interrupt if no tick is waiting, called from the main
+// loop after sched_run
+void sched_idle(void)
+{
+    int16 start;
+    
+    // With interrupts masked a tick can't slip in between the check and the
+    // sleep. A pending interrupt still wakes the CPU, and its handler runs
+    // once interrupts are enabled again.
+    disable_interrupts(GLOBAL);
+    if (g_sched_ticks == g_sched_ticks_seen)
+    {
+        start = get_timer1();
+        sleep();
+        delay_cycles(1);
+        g_sched_sleep_cycles += (int16)(get_timer1() - start);
+    }
+    enable_interrupts(GLOBAL);
+}
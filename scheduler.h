@@ -0,0 +1,51 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Cooperative tick scheduler
+// Tasks are registered with a period and phase in ticks and a priority.
+// sched_tick is called from the timer interrupt, sched_run from the main loop
+// runs every task released since the last call, highest priority first.
+// Tasks run to completion and must not block.
+
+// Between ticks the main loop calls sched_idle, which puts the CPU in IDLE
+// mode until the next interrupt. Peripherals keep running in IDLE, so the
+// timer, CAN and switch interrupts all wake it without an oscillator restart.
+
+// Maximum number of registered tasks
+#ifndef SCHED_MAX_TASKS
+ #define SCHED_MAX_TASKS 12
+#endif
+
+// Instruction cycles per tick, must match the timer 2 setup in main
+#ifndef SCHED_TICK_CYCLES
+ #define SCHED_TICK_CYCLES 5120
+#endif
+
+// Ticks over which the fraction of time spent asleep is measured
+#ifndef SCHED_LOAD_WINDOW
+ #define SCHED_LOAD_WINDOW 1000
+#endif
+
+#bit OSCCON_IDLEN = getenv("BIT:IDLEN")
+
+typedef void (*sched_fn_t)(void);
+
+typedef struct
+{
+    sched_fn_t fn;
+    int16 period;     // Ticks between releases
+    int16 countdown;  // Ticks until the next release
+    int8  priority;   // 0 is the highest priority
+    int1  pending;    // Released but not run yet
+    int16 cycles;     // Instruction cycles used by the last run
+    int16 cycles_max; // Most instruction cycles used by a run
+    int16 overruns;   // Releases that found the previous one still pending
+} sched_task_t;
+
+void sched_init(void);
+int1 sched_add(sched_fn_t fn, int16 period, int16 phase, int8 priority);
+void sched_tick(void);
+void sched_run(void);
+void sched_idle(void);
+
+#endif
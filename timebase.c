@@ -0,0 +1,56 @@
+#include "timebase.h"
+
+static int16 g_timebase_high; // Upper 16 bits of the cycle counter
+
+#int_timer1
+void isr_timer1(void)
+{
+    g_timebase_high++;
+}
+
+void timebase_init(void)
+{
+    g_timebase_high = 0;
+    
+    setup_timer_1(T1_INTERNAL | T1_DIV_BY_1); // Timer 1 free runs at the instruction clock (Fosc/4)
+    clear_interrupt(INT_TIMER1);
+    enable_interrupts(INT_TIMER1);
+}
+
+// Returns the current cycle count, must be called from an interrupt handler
+// so the overflow interrupt can't run in the middle
+int32 timebase_now_isr(void)
+{
+    int16 high;
+    int16 low;
+    
+    high = g_timebase_high;
+    low  = get_timer1();
+    
+    // An overflow that hasn't been handled yet belongs to a low reading
+    if (interrupt_active(INT_TIMER1) && (low < 0x8000))
+    {
+        high++;
+    }
+    
+    return make32(high, low);
+}
+
+// Returns the current cycle count, for the main loop. A copy of
+// timebase_now_isr so neither is shared between main and the interrupts.
+int32 timebase_now(void)
+{
+    int16 high;
+    int16 low;
+    
+    disable_interrupts(GLOBAL);
+    high = g_timebase_high;
+    low  = get_timer1();
+    if (interrupt_active(INT_TIMER1) && (low < 0x8000))
+    {
+        high++;
+    }
+    enable_interrupts(GLOBAL);
+    
+    return make32(high, low);
+}
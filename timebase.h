@@ -0,0 +1,13 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+// Free running 32 bit instruction cycle counter
+// Timer 1 counts instruction cycles (Fosc/4) and its overflow interrupt
+// extends it to 32 bits, which wraps after about 14 minutes at 20MHz.
+// get_timer1() can still be used directly for intervals below 13ms.
+
+void  timebase_init(void);
+int32 timebase_now_isr(void);
+int32 timebase_now(void);
+
+#endif